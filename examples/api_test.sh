@@ -27,6 +27,10 @@ run com.hack_computer.Clippy.Connect open_button notify label
 
 run com.hack_computer.Clippy.Connect open_button clicked nothing
 
+run com.hack_computer.Clippy.ConnectType GtkButton clicked ""
+
+run com.hack_computer.Clippy.DisconnectType GtkButton clicked ""
+
 run com.hack_computer.Clippy.Set open_button label "<'Hola Mundo'>"
 
 run com.hack_computer.Clippy.Get open_button label
@@ -39,5 +43,86 @@ run com.hack_computer.Clippy.Set search_entry text "<'xxHola Mundo'>"
 sleep 1
 run com.hack_computer.Clippy.Emit delete-from-cursor nothing "<('search_entry', 0, 2)>"
 
+run com.hack_computer.Clippy.ConnectFull open_button clicked "" "{'params': <[uint32 0]>}"
+
+run com.hack_computer.Clippy.ConnectFull open_button clicked "" "{'params': <@au []>}"
+
+run com.hack_computer.Clippy.ConnectFull open_button clicked "" "{'params': <[uint32 0]>, 'properties': <['label', 'parent.name']>}"
+
+run com.hack_computer.Clippy.GetEventsSince 0
+
+run com.hack_computer.Clippy.ConnectFull open_button notify label "{'predicate': <('prefix', <'Hola'>)>, 'edge': <true>}"
+
+run com.hack_computer.Clippy.TapInput view "['button', 'key', 'motion']"
+
+sleep 2
+run com.hack_computer.Clippy.UntapInput view
+
+run com.hack_computer.Clippy.WatchGeometry open_button
+
+sleep 1
+run com.hack_computer.Clippy.UnwatchGeometry open_button
+
+run com.hack_computer.Clippy.Bind search_entry text open_button label "['sync-create']" "{}"
+
+sleep 1
+run com.hack_computer.Clippy.Unbind 1
+
+run com.hack_computer.Clippy.AddTrigger "{'object': <'open_button'>, 'signal': <'clicked'>}" "[('Highlight', <('open_button', uint32 500)>)]"
+
+run com.hack_computer.Clippy.Emit clicked "" "<('open_button',)>"
+
+sleep 1
+run com.hack_computer.Clippy.RemoveTrigger 1
+
+run com.hack_computer.Clippy.LessonLoad demo "[('start', [('Message', <('lesson', 'Click the open button', 'dialog-information', 'open_button', uint32 0)>)], {'object': <'open_button'>, 'signal': <'clicked'>, 'timeout': <uint32 5000>}, {'done': 'end', 'timeout': 'end'}), ('end', [('MessageClear', <('lesson',)>)], @a{sv} {}, @a{ss} {})]"
+
+run com.hack_computer.Clippy.LessonStart demo ""
+
+sleep 1
+run com.hack_computer.Clippy.LessonStop demo
+
+run com.hack_computer.Clippy.WaitFor open_button label "('prefix', <'Hola'>)" 1000
+
+run com.hack_computer.Clippy.GetFd open_button label
+
+# SetFd needs a sealed memfd, which gdbus call can not pass
+
+run com.hack_computer.Clippy.EmitWithResult activate "" "<('open_button',)>" "['label', 'sensitive']"
+
+run com.hack_computer.Clippy.Snapshot "" 3 "['label', 'visible']" ""
+
+run com.hack_computer.Clippy.Snapshot "" 0 "[]" GtkButton
+
+run com.hack_computer.Clippy.SubscribeTree open_button.parent "['visible', 'sensitive']"
+
+run com.hack_computer.Clippy.Set open_button visible "<false>"
+
+sleep 1
+run com.hack_computer.Clippy.Set open_button visible "<true>"
+
+run com.hack_computer.Clippy.UnsubscribeTree 1
+
+run com.hack_computer.Clippy.GetRows treeview.model 0 10 "[]"
+
+run com.hack_computer.Clippy.WatchRows treeview.model
+
+run com.hack_computer.Clippy.UnwatchRows treeview.model
+
+run com.hack_computer.Clippy.WatchText view
+
+run com.hack_computer.Clippy.Set view.buffer text "<'Hola Mundo'>"
+
+sleep 1
+run com.hack_computer.Clippy.GetText view 0 "int32 -1"
+
+run com.hack_computer.Clippy.UnwatchText view
+
+run com.hack_computer.Clippy.GetGeometry "['open_button', 'view']"
+
+run com.hack_computer.Clippy.WidgetAt open_button 10 10
+
+run com.hack_computer.Clippy.WidgetsInRect open_button "(0, 0, 200, 100)"
+
 sleep 2
 run org.gtk.Actions.Activate 'quit' [] {}
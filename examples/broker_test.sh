@@ -0,0 +1,46 @@
+#!/bin/bash
+#
+# Runs the broker and a Clippy enabled app on a private session bus
+#
+# broker_test.sh path/to/clippy-broker app [args]
+#
+
+# Restart ourselves inside a private bus
+if [ -z "$CLIPPY_BROKER_TEST" ]; then
+  exec dbus-run-session -- env CLIPPY_BROKER_TEST=1 "$0" "$@"
+fi
+
+function run ()
+{
+  echo $@
+  gdbus call --session --dest com.hack_computer.ClippyBroker --object-path /com/hack_computer/ClippyBroker --method "$@"
+}
+
+BROKER=$1
+shift
+
+G_MESSAGES_DEBUG=all $BROKER&
+gdbus monitor --session --dest com.hack_computer.ClippyBroker&
+
+sleep 1
+GTK_MODULES=clippy-module $@&
+
+sleep 2
+run com.hack_computer.ClippyBroker.ListApps
+
+APP=$(gdbus call --session --dest com.hack_computer.ClippyBroker --object-path /com/hack_computer/ClippyBroker --method com.hack_computer.ClippyBroker.ListApps | grep -o "'[^']*'" | head -1 | tr -d "'")
+
+run com.hack_computer.ClippyBroker.Call $APP Connect "<('open_button', 'clicked', '')>"
+
+run com.hack_computer.ClippyBroker.Call $APP Highlight "<('open_button', uint32 500)>"
+
+run com.hack_computer.ClippyBroker.Call $APP Emit "<('clicked', '', <('open_button',)>)>"
+
+sleep 1
+run com.hack_computer.ClippyBroker.Call $APP Get "<('open_button', 'label')>"
+
+kill %3
+sleep 1
+run com.hack_computer.ClippyBroker.ListApps
+
+kill %1 %2
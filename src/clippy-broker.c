@@ -0,0 +1,486 @@
+/* clippy-broker.c
+ *
+ * Copyright 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <gio/gio.h>
+
+#define CLIPPY_IFACE       "com.hack_computer.Clippy"
+#define CLIPPY_OBJECT_PATH "/com/hack_computer/Clippy"
+
+#define BROKER_NAME        "com.hack_computer.ClippyBroker"
+#define BROKER_IFACE       "com.hack_computer.ClippyBroker"
+#define BROKER_OBJECT_PATH "/com/hack_computer/ClippyBroker"
+
+typedef struct
+{
+  GDBusConnection *connection;
+  GMainLoop       *loop;
+
+  GHashTable      *apps;    /* App id (well-known name) -> ClippyApp */
+  GHashTable      *probes;  /* Name being probed -> owner when probed or "" */
+  GHashTable      *senders; /* Event sender unique name -> ClippyApp */
+
+  guint            name_owner_id;
+  guint            events_id;
+} ClippyBroker;
+
+/* One per Clippy instance, no matter how many names the application owns */
+typedef struct
+{
+  gchar     *sender; /* Clippy EventSender unique name */
+  GPtrArray *names;  /* Well-known names, the first one is used for events */
+} ClippyApp;
+
+typedef struct
+{
+  ClippyBroker *broker;
+  gchar        *id;
+  gchar        *owner;
+} ClippyProbe;
+
+static GDBusInterfaceInfo *iface_info = NULL;
+
+static void
+clippy_app_free (ClippyApp *app)
+{
+  g_ptr_array_unref (app->names);
+  g_free (app->sender);
+  g_free (app);
+}
+
+static void
+broker_emit_signal (ClippyBroker *broker,
+                    const gchar  *signal_name,
+                    GVariant     *parameters)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!g_dbus_connection_emit_signal (broker->connection,
+                                      NULL,
+                                      BROKER_OBJECT_PATH,
+                                      BROKER_IFACE,
+                                      signal_name,
+                                      parameters,
+                                      &error))
+    g_debug ("%s %s %s", __func__, signal_name, error->message);
+}
+
+/* Forget @id, the app goes away with its last name */
+static void
+broker_remove_app (ClippyBroker *broker, const gchar *id)
+{
+  ClippyApp *app;
+  guint i;
+
+  g_hash_table_remove (broker->probes, id);
+
+  if (!(app = g_hash_table_lookup (broker->apps, id)))
+    return;
+
+  g_debug ("%s %s", __func__, id);
+
+  broker_emit_signal (broker, "AppRemoved", g_variant_new ("(s)", id));
+
+  /* The app owns the key */
+  g_hash_table_remove (broker->apps, id);
+
+  for (i = 0; i < app->names->len; i++)
+    if (g_str_equal (g_ptr_array_index (app->names, i), id))
+      {
+        g_ptr_array_remove_index (app->names, i);
+        break;
+      }
+
+  if (!app->names->len)
+    g_hash_table_remove (broker->senders, app->sender);
+}
+
+static void
+on_probe_ready (GObject      *source,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  ClippyProbe *probe = user_data;
+  ClippyBroker *broker = probe->broker;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GVariant) sender = NULL;
+  g_autoptr(GError) error = NULL;
+  const gchar *owner;
+  gchar *name;
+  ClippyApp *app;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
+  owner = g_hash_table_lookup (broker->probes, probe->id);
+
+  /* Ignore replies for names that changed owner while probing */
+  if (!owner || g_strcmp0 (owner, probe->owner))
+    goto out;
+
+  g_hash_table_remove (broker->probes, probe->id);
+
+  if (!reply)
+    {
+      g_debug ("%s %s is not a Clippy app: %s", __func__, probe->id, error->message);
+      goto out;
+    }
+
+  g_variant_get (reply, "(v)", &sender);
+
+  /* Names owned by the same app share its entry */
+  if (!(app = g_hash_table_lookup (broker->senders, g_variant_get_string (sender, NULL))))
+    {
+      app = g_new0 (ClippyApp, 1);
+      app->sender = g_variant_dup_string (sender, NULL);
+      app->names = g_ptr_array_new_with_free_func (g_free);
+      g_hash_table_insert (broker->senders, app->sender, app);
+    }
+
+  name = g_strdup (probe->id);
+  g_ptr_array_add (app->names, name);
+  g_hash_table_insert (broker->apps, name, app);
+
+  g_debug ("%s %s events from %s", __func__, name, app->sender);
+  broker_emit_signal (broker, "AppAdded", g_variant_new ("(s)", name));
+
+out:
+  g_free (probe->id);
+  g_free (probe->owner);
+  g_free (probe);
+}
+
+/*
+ * Check if @id exports the Clippy interface, Clippy is registered on module
+ * init so the object is there as soon as the application owns its name.
+ */
+static void
+broker_probe_app (ClippyBroker *broker, const gchar *id, const gchar *owner)
+{
+  ClippyProbe *probe;
+
+  /* Ignore unique names, the bus itself and ourselves */
+  if (*id == ':' || g_str_equal (id, "org.freedesktop.DBus") || g_str_equal (id, BROKER_NAME))
+    return;
+
+  broker_remove_app (broker, id);
+
+  g_hash_table_insert (broker->probes, g_strdup (id), g_strdup (owner ? owner : ""));
+
+  probe = g_new0 (ClippyProbe, 1);
+  probe->broker = broker;
+  probe->id = g_strdup (id);
+  probe->owner = g_strdup (owner ? owner : "");
+
+  g_dbus_connection_call (broker->connection,
+                          id,
+                          CLIPPY_OBJECT_PATH,
+                          "org.freedesktop.DBus.Properties",
+                          "Get",
+                          g_variant_new ("(ss)", CLIPPY_IFACE, "EventSender"),
+                          G_VARIANT_TYPE ("(v)"),
+                          G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                          -1,
+                          NULL,
+                          on_probe_ready,
+                          probe);
+}
+
+static void
+on_name_owner_changed (GDBusConnection *connection,
+                       const gchar     *sender_name,
+                       const gchar     *object_path,
+                       const gchar     *interface_name,
+                       const gchar     *signal_name,
+                       GVariant        *parameters,
+                       gpointer         user_data)
+{
+  ClippyBroker *broker = user_data;
+  const gchar *name, *old_owner, *new_owner;
+
+  g_variant_get (parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+
+  if (*name == ':')
+    return;
+
+  if (*old_owner)
+    broker_remove_app (broker, name);
+
+  if (*new_owner)
+    broker_probe_app (broker, name, new_owner);
+}
+
+static void
+on_clippy_event (GDBusConnection *connection,
+                 const gchar     *sender_name,
+                 const gchar     *object_path,
+                 const gchar     *interface_name,
+                 const gchar     *signal_name,
+                 GVariant        *parameters,
+                 gpointer         user_data)
+{
+  ClippyBroker *broker = user_data;
+  ClippyApp *app;
+
+  if (!(app = g_hash_table_lookup (broker->senders, sender_name)))
+    return;
+
+  broker_emit_signal (broker,
+                      "Event",
+                      g_variant_new ("(ssv)",
+                                     (const gchar *) g_ptr_array_index (app->names, 0),
+                                     signal_name,
+                                     parameters));
+}
+
+static void
+on_list_names_ready (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  ClippyBroker *broker = user_data;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree const gchar **names = NULL;
+  gint i;
+
+  if (!(reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error)))
+    {
+      g_warning ("Could not list bus names: %s", error->message);
+      return;
+    }
+
+  g_variant_get (reply, "(^a&s)", &names);
+
+  /* Names that already changed owner are being probed already */
+  for (i = 0; names[i]; i++)
+    if (!g_hash_table_contains (broker->apps, names[i]) &&
+        !g_hash_table_contains (broker->probes, names[i]))
+      broker_probe_app (broker, names[i], NULL);
+}
+
+static void
+on_call_ready (GObject      *source,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+  GDBusMethodInvocation *invocation = user_data;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if ((reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error)))
+    g_dbus_method_invocation_return_value (invocation, g_variant_new ("(v)", reply));
+  else
+    g_dbus_method_invocation_return_gerror (invocation, error);
+}
+
+static void
+broker_method_call (GDBusConnection       *connection,
+                    const gchar           *sender,
+                    const gchar           *object_path,
+                    const gchar           *interface_name,
+                    const gchar           *method_name,
+                    GVariant              *parameters,
+                    GDBusMethodInvocation *invocation,
+                    gpointer               user_data)
+{
+  ClippyBroker *broker = user_data;
+
+  if (g_strcmp0 (method_name, "ListApps") == 0)
+    {
+      GVariantBuilder builder;
+      GHashTableIter iter;
+      const gchar *id;
+
+      g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+
+      g_hash_table_iter_init (&iter, broker->apps);
+      while (g_hash_table_iter_next (&iter, (gpointer *) &id, NULL))
+        g_variant_builder_add (&builder, "s", id);
+
+      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(as)", &builder));
+    }
+  else if (g_strcmp0 (method_name, "Call") == 0)
+    {
+      g_autoptr(GVariant) params = NULL;
+      const gchar *id, *method;
+      ClippyApp *app;
+
+      g_variant_get (parameters, "(&s&sv)", &id, &method, &params);
+
+      if (!(app = g_hash_table_lookup (broker->apps, id)))
+        {
+          g_dbus_method_invocation_return_error (invocation,
+                                                 G_DBUS_ERROR,
+                                                 G_DBUS_ERROR_SERVICE_UNKNOWN,
+                                                 "No Clippy app '%s'",
+                                                 id);
+          return;
+        }
+
+      if (!g_variant_is_of_type (params, G_VARIANT_TYPE_TUPLE))
+        {
+          g_dbus_method_invocation_return_error (invocation,
+                                                 G_DBUS_ERROR,
+                                                 G_DBUS_ERROR_INVALID_ARGS,
+                                                 "Parameters for %s have to be a tuple",
+                                                 method);
+          return;
+        }
+
+      g_dbus_connection_call (broker->connection,
+                              id,
+                              CLIPPY_OBJECT_PATH,
+                              CLIPPY_IFACE,
+                              method,
+                              params,
+                              NULL,
+                              G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                              -1,
+                              NULL,
+                              on_call_ready,
+                              invocation);
+    }
+}
+
+static void
+on_bus_acquired (GDBusConnection *connection,
+                 const gchar     *name,
+                 gpointer         user_data)
+{
+  const static GDBusInterfaceVTable vtable = { broker_method_call, NULL, NULL };
+  ClippyBroker *broker = user_data;
+  g_autoptr(GError) error = NULL;
+
+  broker->connection = g_object_ref (connection);
+
+  g_dbus_connection_register_object (connection,
+                                     BROKER_OBJECT_PATH,
+                                     iface_info,
+                                     &vtable,
+                                     broker,
+                                     NULL,
+                                     &error);
+  if (error)
+    {
+      g_critical ("Failed to register broker object: %s", error->message);
+      g_main_loop_quit (broker->loop);
+      return;
+    }
+
+  /* One match rule for every app events */
+  broker->events_id = g_dbus_connection_signal_subscribe (connection,
+                                                          NULL,
+                                                          CLIPPY_IFACE,
+                                                          NULL,
+                                                          CLIPPY_OBJECT_PATH,
+                                                          NULL,
+                                                          G_DBUS_SIGNAL_FLAGS_NONE,
+                                                          on_clippy_event,
+                                                          broker,
+                                                          NULL);
+
+  broker->name_owner_id = g_dbus_connection_signal_subscribe (connection,
+                                                              "org.freedesktop.DBus",
+                                                              "org.freedesktop.DBus",
+                                                              "NameOwnerChanged",
+                                                              "/org/freedesktop/DBus",
+                                                              NULL,
+                                                              G_DBUS_SIGNAL_FLAGS_NONE,
+                                                              on_name_owner_changed,
+                                                              broker,
+                                                              NULL);
+
+  /* Probe apps that were already running */
+  g_dbus_connection_call (connection,
+                          "org.freedesktop.DBus",
+                          "/org/freedesktop/DBus",
+                          "org.freedesktop.DBus",
+                          "ListNames",
+                          NULL,
+                          G_VARIANT_TYPE ("(as)"),
+                          G_DBUS_CALL_FLAGS_NONE,
+                          -1,
+                          NULL,
+                          on_list_names_ready,
+                          broker);
+}
+
+static void
+on_name_lost (GDBusConnection *connection,
+              const gchar     *name,
+              gpointer         user_data)
+{
+  ClippyBroker *broker = user_data;
+
+  g_warning ("Could not own %s name, is another broker running?", name);
+  g_main_loop_quit (broker->loop);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr(GDBusNodeInfo) info = NULL;
+  g_autoptr(GBytes) xml = NULL;
+  g_autoptr(GError) error = NULL;
+  ClippyBroker broker = { 0, };
+  guint owner_id;
+
+  xml = g_resources_lookup_data ("/com/endlessm/clippy/broker.xml", 0, NULL);
+  if (!(info = g_dbus_node_info_new_for_xml (g_bytes_get_data (xml, NULL), &error)))
+    {
+      g_critical ("Could not parse broker interface: %s", error->message);
+      return 1;
+    }
+
+  iface_info = g_dbus_node_info_lookup_interface (info, BROKER_IFACE);
+  g_assert (iface_info != NULL);
+
+  broker.loop = g_main_loop_new (NULL, FALSE);
+  broker.apps = g_hash_table_new (g_str_hash, g_str_equal);
+  broker.probes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  broker.senders = g_hash_table_new_full (g_str_hash,
+                                          g_str_equal,
+                                          NULL,
+                                          (GDestroyNotify) clippy_app_free);
+
+  owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
+                             BROKER_NAME,
+                             G_BUS_NAME_OWNER_FLAGS_NONE,
+                             on_bus_acquired,
+                             NULL,
+                             on_name_lost,
+                             &broker,
+                             NULL);
+
+  g_main_loop_run (broker.loop);
+
+  g_bus_unown_name (owner_id);
+
+  if (broker.connection)
+    {
+      g_dbus_connection_signal_unsubscribe (broker.connection, broker.events_id);
+      g_dbus_connection_signal_unsubscribe (broker.connection, broker.name_owner_id);
+      g_object_unref (broker.connection);
+    }
+
+  g_hash_table_unref (broker.apps);
+  g_hash_table_unref (broker.probes);
+  g_hash_table_unref (broker.senders);
+  g_main_loop_unref (broker.loop);
+
+  return 0;
+}
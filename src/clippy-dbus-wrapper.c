@@ -160,13 +160,13 @@ _skeleton_handle_get_property (GDBusConnection *connection,
 
   g_debug ("%s %s %s %s %s", __func__, sender, object_path, interface_name, property_name);
 
-  if (!(pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (priv->object), property_name)))
+  if (!(pspec = object_find_property (priv->object, property_name)))
     return NULL;
 
   g_value_init (&gvalue, pspec->value_type);
   g_object_get_property (priv->object, property_name, &gvalue);
 
-  return variant_new_value (&gvalue);
+  return pspec_variant_new_value (pspec, &gvalue);
 }
 
 static gboolean
@@ -185,11 +185,11 @@ _skeleton_handle_set_property (GDBusConnection *connection,
 
   g_debug ("%s %s %s %s %s", __func__, sender, object_path, interface_name, property_name);
 
-  if (!(pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (priv->object), property_name)))
+  if (!(pspec = object_find_property (priv->object, property_name)))
     return FALSE;
 
   g_value_init (&gvalue, pspec->value_type);
-  value_set_variant (&gvalue, variant);
+  pspec_value_set_variant (pspec, &gvalue, variant);
   g_object_set_property (priv->object, property_name, &gvalue);
 
   return TRUE;
@@ -239,7 +239,7 @@ clippy_dbus_wrapper_skeleton_dbus_interface_get_properties (GDBusInterfaceSkelet
 
       g_value_init (&value, pspec->value_type);
       g_object_get_property (priv->object, pspec->name, &value);
-      g_variant_builder_add (b, "{sv}", pspec->name, variant_new_value (&value));
+      g_variant_builder_add (b, "{sv}", pspec->name, pspec_variant_new_value (pspec, &value));
     }
   return g_variant_builder_end (b);
 }
@@ -311,7 +311,7 @@ on_object_notify (GObject           *gobject,
 
   g_value_init (&value, pspec->value_type);
   g_object_get_property (gobject, pspec->name, &value);
-  g_variant_builder_add (&builder, "{sv}", pspec->name, variant_new_value (&value));
+  g_variant_builder_add (&builder, "{sv}", pspec->name, pspec_variant_new_value (pspec, &value));
   g_variant_builder_add (&invalidated_builder, "s", pspec->name);
 
   g_dbus_connection_emit_signal (priv->connection,
@@ -0,0 +1,456 @@
+/* clippy-events.c
+ *
+ * Copyright 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "clippy-events.h"
+
+/* Outgoing bytes allowed before events start waiting in the pending queue */
+#define EVENTS_HIGH_WATER  (1024 * 1024)
+
+/* Outgoing bytes the connection has to get down to before we resume */
+#define EVENTS_LOW_WATER   (256 * 1024)
+
+/* Max number of events waiting, low priority events are dropped after this */
+#define EVENTS_MAX_PENDING 4096
+
+/* Max number of events waiting, every event is dropped after this */
+#define EVENTS_MAX_QUEUED  (4 * EVENTS_MAX_PENDING)
+
+/* Rough size of a signal message header */
+#define EVENTS_HEADER_SIZE 128
+
+/* Set to emit events on the main connection with their original signatures,
+ * like before EventSender existed and events were sequenced.
+ */
+#define EVENTS_MAIN_CONNECTION_ENV "CLIPPY_EVENTS_MAIN_CONNECTION"
+
+/* Number of events kept in the journal for GetEventsSince */
+#define EVENTS_JOURNAL_SIZE 2048
+
+typedef struct
+{
+  const gchar *signal_name;
+  gchar       *merge_key;
+  GVariant    *parameters;
+  guint        dropped;     /* Dropped events, for EventsDropped markers */
+  guint64      sequence;    /* Marker sequence number */
+} ClippyEvent;
+
+typedef struct
+{
+  const gchar *signal_name;
+  GVariant    *parameters;
+} ClippyJournalEntry;
+
+struct _ClippyEvents
+{
+  GDBusConnection *connection;
+  gchar           *object_path;
+  gchar           *interface_name;
+
+  gsize            outstanding; /* Bytes emitted but not flushed yet */
+  gsize            flushing;    /* Bytes covered by the flush in progress */
+
+  GQueue           pending;     /* Events waiting for the connection */
+  GHashTable      *mergeable;   /* merge key -> pending GList link */
+  GHashTable      *legacy;      /* signal name -> unsequenced signal name */
+  gboolean         compat;      /* Emit legacy names instead */
+
+  guint64          sequence;    /* Sequence number of the last event */
+  ClippyJournalEntry journal[EVENTS_JOURNAL_SIZE]; /* Ring indexed by sequence */
+
+  GCancellable    *cancellable;
+};
+
+static void events_flush (ClippyEvents *events);
+
+static void
+clippy_event_free (ClippyEvent *event)
+{
+  g_free (event->merge_key);
+  g_clear_pointer (&event->parameters, g_variant_unref);
+  g_free (event);
+}
+
+/*
+ * Open a private session bus connection used only to emit events.
+ * Every GDBusConnection has its own outgoing queue, so method replies sent on
+ * the main connection never have to wait behind a flood of queued signals.
+ */
+static GDBusConnection *
+events_connection_new (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *address = NULL;
+  GDBusConnection *connection = NULL;
+
+  address = g_dbus_address_get_for_bus_sync (G_BUS_TYPE_SESSION, NULL, &error);
+
+  if (address)
+    connection = g_dbus_connection_new_for_address_sync (address,
+                                                         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                         G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                         NULL,
+                                                         NULL,
+                                                         &error);
+  if (error)
+    {
+      g_warning ("Failed to open events connection, using the main one: %s",
+                 error->message);
+      return NULL;
+    }
+
+  return connection;
+}
+
+ClippyEvents *
+clippy_events_new (GDBusConnection *fallback,
+                   const gchar     *object_path,
+                   const gchar     *interface_name)
+{
+  ClippyEvents *events = g_new0 (ClippyEvents, 1);
+
+  /* Compatibility mode for clients matching signals on the app bus name */
+  events->compat = g_getenv (EVENTS_MAIN_CONNECTION_ENV) != NULL;
+
+  if (events->compat || !(events->connection = events_connection_new ()))
+    events->connection = g_object_ref (fallback);
+
+  events->object_path = g_strdup (object_path);
+  events->interface_name = g_strdup (interface_name);
+  events->mergeable = g_hash_table_new (g_str_hash, g_str_equal);
+  events->legacy = g_hash_table_new (g_str_hash, g_str_equal);
+  events->cancellable = g_cancellable_new ();
+  g_queue_init (&events->pending);
+
+  return events;
+}
+
+void
+clippy_events_free (ClippyEvents *events)
+{
+  gint i;
+
+  /* Makes sure on_events_flushed() does not touch us after this */
+  g_cancellable_cancel (events->cancellable);
+
+  g_queue_foreach (&events->pending, (GFunc) clippy_event_free, NULL);
+  g_queue_clear (&events->pending);
+
+  for (i = 0; i < EVENTS_JOURNAL_SIZE; i++)
+    g_clear_pointer (&events->journal[i].parameters, g_variant_unref);
+
+  g_clear_object (&events->cancellable);
+  g_clear_object (&events->connection);
+  g_clear_pointer (&events->mergeable, g_hash_table_unref);
+  g_clear_pointer (&events->legacy, g_hash_table_unref);
+  g_clear_pointer (&events->object_path, g_free);
+  g_clear_pointer (&events->interface_name, g_free);
+  g_free (events);
+}
+
+GDBusConnection *
+clippy_events_get_connection (ClippyEvents *events)
+{
+  return events->connection;
+}
+
+guint64
+clippy_events_get_sequence (ClippyEvents *events)
+{
+  return events->sequence;
+}
+
+/*
+ * In compatibility mode emit @signal_name events as @legacy_name instead,
+ * without the sequence number, for clients that expect the signature it had
+ * before sequencing. Only one of them is ever emitted.
+ */
+void
+clippy_events_add_legacy (ClippyEvents *events,
+                          const gchar  *signal_name,
+                          const gchar  *legacy_name)
+{
+  g_hash_table_insert (events->legacy,
+                       (gpointer) g_intern_string (signal_name),
+                       (gpointer) g_intern_string (legacy_name));
+}
+
+/*
+ * Returns a (ba(sv)) tuple with every journaled event after @sequence, or
+ * TRUE and no events if some of them are not in the journal anymore or
+ * @sequence is ahead of us, for example because the application restarted.
+ */
+GVariant *
+clippy_events_get_since (ClippyEvents *events,
+                         guint64       sequence)
+{
+  GVariantBuilder builder;
+  guint64 oldest, seq;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sv)"));
+
+  oldest = (events->sequence > EVENTS_JOURNAL_SIZE) ?
+    events->sequence - EVENTS_JOURNAL_SIZE + 1 : 1;
+
+  if (sequence + 1 < oldest || sequence > events->sequence)
+    return g_variant_new ("(b@a(sv))", TRUE, g_variant_builder_end (&builder));
+
+  for (seq = sequence + 1; seq <= events->sequence; seq++)
+    {
+      ClippyJournalEntry *entry = &events->journal[seq % EVENTS_JOURNAL_SIZE];
+
+      g_variant_builder_add (&builder, "(s@v)",
+                             entry->signal_name,
+                             g_variant_new_variant (entry->parameters));
+    }
+
+  return g_variant_new ("(b@a(sv))", FALSE, g_variant_builder_end (&builder));
+}
+
+/* Appends the sequence number to the signal parameters tuple */
+static GVariant *
+events_parameters_sequenced (GVariant *parameters,
+                             guint64   sequence)
+{
+  GVariantBuilder builder;
+  GVariantIter iter;
+  GVariant *child;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_TUPLE);
+
+  g_variant_iter_init (&iter, parameters);
+  while ((child = g_variant_iter_next_value (&iter)))
+    {
+      g_variant_builder_add_value (&builder, child);
+      g_variant_unref (child);
+    }
+
+  g_variant_builder_add (&builder, "t", sequence);
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static void
+events_journal_add (ClippyEvents *events,
+                    guint64       sequence,
+                    const gchar  *signal_name,
+                    GVariant     *parameters)
+{
+  ClippyJournalEntry *entry = &events->journal[sequence % EVENTS_JOURNAL_SIZE];
+
+  g_clear_pointer (&entry->parameters, g_variant_unref);
+  entry->signal_name = g_intern_string (signal_name);
+  entry->parameters = g_variant_ref (parameters);
+}
+
+/* Strips the sequence number added by events_parameters_sequenced() */
+static GVariant *
+events_parameters_unsequenced (GVariant *parameters)
+{
+  GVariantBuilder builder;
+  gsize i, n = g_variant_n_children (parameters) - 1;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_TUPLE);
+
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) child = g_variant_get_child_value (parameters, i);
+      g_variant_builder_add_value (&builder, child);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+static void
+events_emit_signal (ClippyEvents *events,
+                    const gchar  *signal_name,
+                    GVariant     *parameters)
+{
+  g_autoptr(GError) error = NULL;
+
+  events->outstanding += EVENTS_HEADER_SIZE + g_variant_get_size (parameters);
+
+  if (!g_dbus_connection_emit_signal (events->connection,
+                                      NULL,
+                                      events->object_path,
+                                      events->interface_name,
+                                      signal_name,
+                                      parameters,
+                                      &error))
+    g_debug ("%s %s %s", __func__, signal_name, error->message);
+}
+
+static void
+events_send (ClippyEvents *events,
+             const gchar  *signal_name,
+             GVariant     *parameters)
+{
+  const gchar *legacy_name;
+
+  if (events->compat && (legacy_name = g_hash_table_lookup (events->legacy, signal_name)))
+    events_emit_signal (events, legacy_name, events_parameters_unsequenced (parameters));
+  else
+    events_emit_signal (events, signal_name, parameters);
+
+  events_flush (events);
+}
+
+static void
+events_drain (ClippyEvents *events)
+{
+  ClippyEvent *event;
+
+  if (events->outstanding > EVENTS_LOW_WATER)
+    return;
+
+  while (events->outstanding < EVENTS_HIGH_WATER &&
+         (event = g_queue_pop_head (&events->pending)))
+    {
+      if (event->merge_key)
+        g_hash_table_remove (events->mergeable, event->merge_key);
+
+      if (event->dropped)
+        event->parameters = g_variant_ref_sink (g_variant_new ("(ut)", event->dropped, event->sequence));
+
+      events_send (events, event->signal_name, event->parameters);
+      clippy_event_free (event);
+    }
+}
+
+static void
+on_events_flushed (GObject      *source,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  ClippyEvents *events = user_data;
+
+  if (!g_dbus_connection_flush_finish (G_DBUS_CONNECTION (source), result, &error) &&
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
+
+  /* Everything emitted before the flush started is out of our queue */
+  events->outstanding -= events->flushing;
+  events->flushing = 0;
+
+  events_drain (events);
+  events_flush (events);
+}
+
+/*
+ * GDBus does not expose the size of its outgoing queue, so we keep count of
+ * the bytes we emitted and use one flush at a time to know when they left.
+ */
+static void
+events_flush (ClippyEvents *events)
+{
+  if (events->flushing || !events->outstanding)
+    return;
+
+  events->flushing = events->outstanding;
+  g_dbus_connection_flush (events->connection,
+                           events->cancellable,
+                           on_events_flushed,
+                           events);
+}
+
+/*
+ * Add a sequence number to @parameters, keep the event in the journal and
+ * emit @signal_name right away if the connection is keeping up, otherwise
+ * queue it. While queued, events with the same @merge_key are merged into the
+ * newest one, and once the queue is full low priority events are dropped and
+ * reported with an EventsDropped marker queued where they would have been.
+ * High priority events are only dropped past EVENTS_MAX_QUEUED, so memory
+ * stays bounded even if the consumer stops reading.
+ */
+void
+clippy_events_emit (ClippyEvents        *events,
+                    ClippyEventPriority  priority,
+                    const gchar         *merge_key,
+                    const gchar         *signal_name,
+                    GVariant            *parameters)
+{
+  g_autoptr(GVariant) unsequenced = g_variant_ref_sink (parameters);
+  g_autoptr(GVariant) params = NULL;
+  ClippyEvent *event;
+  GList *link;
+
+  params = events_parameters_sequenced (unsequenced, ++events->sequence);
+  events_journal_add (events, events->sequence, signal_name, params);
+
+  if (g_queue_is_empty (&events->pending) &&
+      events->outstanding < EVENTS_HIGH_WATER)
+    {
+      events_send (events, signal_name, params);
+      return;
+    }
+
+  /* Replace pending event value and move it to the tail with its new
+   * sequence number, so sequence numbers go out in order.
+   */
+  if (merge_key && (link = g_hash_table_lookup (events->mergeable, merge_key)))
+    {
+      event = link->data;
+      g_queue_unlink (&events->pending, link);
+      g_queue_push_tail_link (&events->pending, link);
+
+      g_variant_unref (event->parameters);
+      event->parameters = g_steal_pointer (&params);
+      return;
+    }
+
+  if ((priority == CLIPPY_EVENT_PRIORITY_LOW && events->pending.length >= EVENTS_MAX_PENDING) ||
+      events->pending.length >= EVENTS_MAX_QUEUED)
+    {
+      event = g_queue_peek_tail (&events->pending);
+
+      /* Consecutive drops share the marker, sequenced after the first one */
+      if (!event->dropped)
+        {
+          event = g_new0 (ClippyEvent, 1);
+          event->signal_name = g_intern_static_string ("EventsDropped");
+          event->sequence = ++events->sequence;
+          g_queue_push_tail (&events->pending, event);
+        }
+
+      event->dropped++;
+
+      /* Keep the journaled marker count up to date while it is there */
+      if (events->sequence - event->sequence < EVENTS_JOURNAL_SIZE)
+        {
+          g_autoptr(GVariant) marker = g_variant_ref_sink (g_variant_new ("(ut)",
+                                                                          event->dropped,
+                                                                          event->sequence));
+
+          events_journal_add (events, event->sequence, event->signal_name, marker);
+        }
+
+      return;
+    }
+
+  event = g_new0 (ClippyEvent, 1);
+  event->signal_name = g_intern_string (signal_name);
+  event->merge_key = g_strdup (merge_key);
+  event->parameters = g_steal_pointer (&params);
+
+  g_queue_push_tail (&events->pending, event);
+
+  if (event->merge_key)
+    g_hash_table_insert (events->mergeable, event->merge_key, events->pending.tail);
+}
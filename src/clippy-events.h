@@ -0,0 +1,57 @@
+/* clippy-events.h
+ *
+ * Copyright 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  CLIPPY_EVENT_PRIORITY_LOW,  /* Dropped if the consumer falls too far behind */
+  CLIPPY_EVENT_PRIORITY_HIGH  /* Only dropped if the consumer stops reading */
+} ClippyEventPriority;
+
+typedef struct _ClippyEvents ClippyEvents;
+
+ClippyEvents    *clippy_events_new            (GDBusConnection     *fallback,
+                                               const gchar         *object_path,
+                                               const gchar         *interface_name);
+
+void             clippy_events_free           (ClippyEvents        *events);
+
+GDBusConnection *clippy_events_get_connection (ClippyEvents        *events);
+
+guint64          clippy_events_get_sequence   (ClippyEvents        *events);
+
+void             clippy_events_add_legacy     (ClippyEvents        *events,
+                                               const gchar         *signal_name,
+                                               const gchar         *legacy_name);
+
+GVariant        *clippy_events_get_since      (ClippyEvents        *events,
+                                               guint64              sequence);
+
+void             clippy_events_emit           (ClippyEvents        *events,
+                                               ClippyEventPriority  priority,
+                                               const gchar         *merge_key,
+                                               const gchar         *signal_name,
+                                               GVariant            *parameters);
+
+G_END_DECLS
@@ -0,0 +1,135 @@
+/* clippy-predicate.c
+ *
+ * Copyright 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <string.h>
+#include "clippy-predicate.h"
+#include "utils.h"
+
+typedef enum
+{
+  PREDICATE_EQUALS,
+  PREDICATE_NOT_EQUALS,
+  PREDICATE_RANGE,
+  PREDICATE_PREFIX,
+  PREDICATE_CONTAINS
+} PredicateOp;
+
+struct _ClippyPredicate
+{
+  PredicateOp  op;
+  GVariant    *operand;
+  gdouble      min, max; /* PREDICATE_RANGE bounds */
+};
+
+static const gchar *op_names[] = {
+  "equals",
+  "not-equals",
+  "range",
+  "prefix",
+  "contains",
+  NULL
+};
+
+/*
+ * Create a predicate from a (sv) @spec with the operation name and operand:
+ *   ('equals', <value>), ('not-equals', <value>), ('range', <(min, max)>),
+ *   ('prefix', <'string'>) or ('contains', <'string'>)
+ */
+ClippyPredicate *
+clippy_predicate_new (GVariant *spec, GError **error)
+{
+  g_autoptr(ClippyPredicate) predicate = g_new0 (ClippyPredicate, 1);
+  g_autofree gchar *op = NULL;
+  gint i;
+
+  clippy_return_val_if_fail (g_variant_is_of_type (spec, G_VARIANT_TYPE ("(sv)")),
+                             NULL, error, CLIPPY_WRONG_OPTION,
+                             "Predicate must be of type (sv) not %s",
+                             g_variant_get_type_string (spec));
+
+  g_variant_get (spec, "(sv)", &op, &predicate->operand);
+
+  for (i = 0; op_names[i]; i++)
+    if (g_strcmp0 (op, op_names[i]) == 0)
+      break;
+
+  clippy_return_val_if_fail (op_names[i],
+                             NULL, error, CLIPPY_WRONG_OPTION,
+                             "Unknown predicate operation '%s'",
+                             op);
+
+  predicate->op = i;
+
+  switch (predicate->op)
+    {
+      case PREDICATE_RANGE:
+        clippy_return_val_if_fail (g_variant_is_of_type (predicate->operand, G_VARIANT_TYPE ("(dd)")),
+                                   NULL, error, CLIPPY_WRONG_OPTION,
+                                   "Range predicate operand must be of type (dd) not %s",
+                                   g_variant_get_type_string (predicate->operand));
+        g_variant_get (predicate->operand, "(dd)", &predicate->min, &predicate->max);
+      break;
+      case PREDICATE_PREFIX:
+      case PREDICATE_CONTAINS:
+        clippy_return_val_if_fail (g_variant_is_of_type (predicate->operand, G_VARIANT_TYPE_STRING),
+                                   NULL, error, CLIPPY_WRONG_OPTION,
+                                   "Predicate '%s' operand must be a string",
+                                   op);
+      break;
+      default:
+      break;
+    }
+
+  return g_steal_pointer (&predicate);
+}
+
+void
+clippy_predicate_free (ClippyPredicate *predicate)
+{
+  g_clear_pointer (&predicate->operand, g_variant_unref);
+  g_free (predicate);
+}
+
+gboolean
+clippy_predicate_eval (ClippyPredicate *predicate, const GValue *value)
+{
+  g_autoptr(GVariant) variant = g_variant_ref_sink (variant_new_value (value));
+  gdouble number;
+
+  switch (predicate->op)
+    {
+      case PREDICATE_EQUALS:
+        return variant_equal_value (variant, predicate->operand);
+      case PREDICATE_NOT_EQUALS:
+        return !variant_equal_value (variant, predicate->operand);
+      case PREDICATE_RANGE:
+        return variant_get_number (variant, &number) &&
+               number >= predicate->min && number <= predicate->max;
+      case PREDICATE_PREFIX:
+        return g_variant_is_of_type (variant, G_VARIANT_TYPE_STRING) &&
+               g_str_has_prefix (g_variant_get_string (variant, NULL),
+                                 g_variant_get_string (predicate->operand, NULL));
+      case PREDICATE_CONTAINS:
+        return g_variant_is_of_type (variant, G_VARIANT_TYPE_STRING) &&
+               strstr (g_variant_get_string (variant, NULL),
+                       g_variant_get_string (predicate->operand, NULL)) != NULL;
+    }
+
+  return FALSE;
+}
@@ -0,0 +1,38 @@
+/* clippy-predicate.h
+ *
+ * Copyright 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef struct _ClippyPredicate ClippyPredicate;
+
+ClippyPredicate *clippy_predicate_new  (GVariant         *spec,
+                                        GError          **error);
+
+void             clippy_predicate_free (ClippyPredicate  *predicate);
+
+gboolean         clippy_predicate_eval (ClippyPredicate  *predicate,
+                                        const GValue     *value);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ClippyPredicate, clippy_predicate_free)
+
+G_END_DECLS
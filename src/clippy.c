@@ -19,77 +19,410 @@
  * Author: Juan Pablo Ugarte <ugarte@endlessm.com>
  */
 
+#define _GNU_SOURCE
+#include "clippy-config.h"
+
 #include <gmodule.h>
 #include <gtk/gtk.h>
+#include <gio/gunixfdlist.h>
+
+#ifdef HAVE_MEMFD_CREATE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include "utils.h"
 #include "clippy-dbus-wrapper.h"
+#include "clippy-events.h"
+#include "clippy-predicate.h"
 
 #define HIGHLIGHT_CLASS "highlight"
 #define DBUS_IFACE      "com.hack_computer.Clippy"
 #define DBUS_OBJECT_PATH "/com/hack_computer/Clippy"
 #define CLIPPY_TIMEOUT_KEY "ClippyTimeOut"
 
+/* Hit test grid cell size in pixels */
+#define HIT_INDEX_CELL_SIZE 64
+
+/* WaitFor timeout when none is given, below the default D-Bus call timeout */
+#define WAIT_FOR_DEFAULT_TIMEOUT 20000 /* ms */
+
+/* Maximum time GetGeometry waits for a paint */
+#define GEOMETRY_QUERY_TIMEOUT 500 /* ms */
+
+/* Maximum time batched changes wait for a paint, the toplevel might unmap first */
+#define FRAME_FLUSH_TIMEOUT 500 /* ms */
+
+/* Serialized value size from which GetFd passes values in a memfd */
+#define DEFAULT_FD_THRESHOLD (64 * 1024)
+
+#define LESSON_OUTCOME_DONE    "done"
+#define LESSON_OUTCOME_TIMEOUT "timeout"
+#define LESSON_OUTCOME_ERROR   "error"
+#define LESSON_OUTCOME_STOPPED "stopped"
+
 static GDBusInterfaceInfo *iface_info = NULL;
+static guint notify_signal_id = 0;
 
-typedef struct
+typedef struct _ClippySubscription ClippySubscription;
+typedef struct _Clippy Clippy;
+typedef struct _ClippyLesson ClippyLesson;
+
+static void clippy_call (Clippy       *clip,
+                         const gchar  *method_name,
+                         GVariant     *parameters,
+                         GVariant    **return_value,
+                         GError      **error);
+static void clippy_lesson_step_done (ClippyLesson *lesson, const gchar *outcome);
+static void clippy_tree_hooks_update (Clippy *clip);
+static void clippy_hit_hooks_update (Clippy *clip);
+static void clippy_geometry_hooks_update (Clippy *clip);
+
+struct _Clippy
 {
   GDBusConnection *connection; /* DBus connection */
+  ClippyEvents    *events;     /* Events emitter on a dedicated connection */
   GtkCssProvider *provider; /* Clippy Css provider */
   GHashTable     *widgets;  /* Highlighted widget */
 
   GHashTable     *messages; /* ShowMessage GtkPopover table */
 
-  GClosure       *signal_closure;
-  GClosure       *notify_closure;
+  ClippySubscription *subscription; /* Default Connect subscription */
+  GClosure       *signal_closure;     /* Default Connect closure */
+
+  GThread        *thread;  /* Main thread */
+  gpointer        handoff; /* ClippyHandoff stack from other threads */
+
+  GHashTable     *type_hooks; /* ConnectType emission hooks */
+
+  GHashTable     *taps;          /* TapInput root id -> ClippyTap */
+  gboolean        event_handler; /* Our GDK event handler is installed */
+
+  GHashTable     *geometry_watches; /* Object id -> ClippyGeometryWatch */
+  gulong          geometry_adjustment_hook;
+
+  GHashTable     *rows_watches;  /* Model id -> ClippyRowsWatch */
+
+  GHashTable     *text_watches;  /* Object id -> ClippyTextWatch */
+
+  GHashTable     *hit_indexes;   /* Toplevel -> HitIndex */
+  gulong          hit_allocate_hook;
+  gulong          hit_parent_set_hook;
+  gulong          hit_unmap_hook;
+  gulong          hit_adjustment_hook;
+
+  GHashTable     *tree_subs;     /* SubscribeTree id -> ClippyTreeSub */
+  guint           last_tree_sub;
+  gulong          parent_set_hook;
+  gulong          tree_notify_hook;
+
+  GHashTable     *bindings;     /* Bind id -> ClippyBinding */
+  guint           last_binding;
+
+  GHashTable     *triggers;     /* Trigger id -> ClippyTrigger */
+  guint           last_trigger;
+
+  GHashTable     *lessons;      /* Lesson name -> ClippyLesson */
+
+  GHashTable     *waits;        /* Pending WaitFor ClippyWait set */
+
+  guint           fd_threshold; /* GetFd out of band size, 0 to disable */
 
   gchar          *css;
 
   GDBusObjectManagerServer *manager;
-} Clippy;
+};
 
 static inline void
-clippy_emit_signal (Clippy      *clip,
-                    const gchar *signal_name,
-                    const gchar *format,
+clippy_emit_signal (Clippy              *clip,
+                    ClippyEventPriority  priority,
+                    const gchar         *merge_key,
+                    const gchar         *signal_name,
+                    const gchar         *format,
                     ...)
 {
   va_list params;
 
   va_start (params, format);
-  g_dbus_connection_emit_signal (clip->connection,
-                                 NULL,
-                                 DBUS_OBJECT_PATH,
-                                 DBUS_IFACE,
-                                 signal_name,
-                                 g_variant_new_va (format, NULL, &params),
-                                 NULL);
+  clippy_events_emit (clip->events,
+                      priority,
+                      merge_key,
+                      signal_name,
+                      g_variant_new_va (format, NULL, &params));
   va_end (params);
 }
 
+/* Subscription options shared by every emission of a Connect closure */
+struct _ClippySubscription
+{
+  gint     ref_count;  /* Handoffs from other threads keep it alive */
+  Clippy  *clip;
+  guint64  params;     /* Mask of parameters to marshal, bit 0 is the instance */
+  GStrv    properties; /* Instance property paths to read on emission */
+
+  ClippyPredicate *predicate; /* Notify value condition to emit */
+  gboolean         edge;      /* Only emit when predicate becomes true */
+  gboolean         matched;   /* Last predicate result */
+
+  GVariant        *actions;   /* Trigger a(sv) method calls to run instead of emitting */
+  guint            trigger;   /* Trigger id */
+  gboolean         running;   /* Trigger actions are running */
+
+  ClippyLesson    *lesson;    /* Lesson waiting for this emission */
+  gboolean         detached;  /* Owner went away, ignore emissions still queued */
+};
+
+#define SUBSCRIPTION_ALL_PARAMS G_MAXUINT64
+
+static ClippySubscription *
+clippy_subscription_new (Clippy *clip)
+{
+  ClippySubscription *sub = g_new0 (ClippySubscription, 1);
+
+  sub->ref_count = 1;
+  sub->clip = clip;
+  sub->params = SUBSCRIPTION_ALL_PARAMS;
+
+  return sub;
+}
+
+static ClippySubscription *
+clippy_subscription_ref (ClippySubscription *sub)
+{
+  g_atomic_int_inc (&sub->ref_count);
+  return sub;
+}
+
+/* The last reference might be dropped from any thread */
+static void
+clippy_subscription_unref (ClippySubscription *sub)
+{
+  if (!g_atomic_int_dec_and_test (&sub->ref_count))
+    return;
+
+  g_strfreev (sub->properties);
+  g_clear_pointer (&sub->predicate, clippy_predicate_free);
+  g_clear_pointer (&sub->actions, g_variant_unref);
+  g_free (sub);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ClippySubscription, clippy_subscription_unref)
+
+typedef struct
+{
+  const gchar *name;
+  const gchar *type;
+} SubscriptionOption;
+
+static const SubscriptionOption subscription_options[] = {
+  { "params",     "au" },
+  { "properties", "as" },
+  { "predicate",  "(sv)" },
+  { "edge",       "b" },
+  { NULL, }
+};
+
+/* Trigger event keys besides subscription options */
+static const SubscriptionOption event_options[] = {
+  { "object",  "s" },
+  { "signal",  "s" },
+  { "detail",  "s" },
+  { NULL, }
+};
+
+/* Lesson step wait keys besides subscription options */
+static const SubscriptionOption wait_options[] = {
+  { "object",  "s" },
+  { "signal",  "s" },
+  { "detail",  "s" },
+  { "timeout", "u" },
+  { NULL, }
+};
+
+static const SubscriptionOption *
+subscription_option_lookup (const SubscriptionOption *options, const gchar *name)
+{
+  for (; options && options->name; options++)
+    if (g_str_equal (options->name, name))
+      return options;
+
+  return NULL;
+}
+
+/*
+ * Parse ConnectFull @options, @extra lists other keys allowed in @options.
+ * Unknown options and options of the wrong type are an error.
+ */
+static ClippySubscription *
+clippy_subscription_new_from_options (Clippy                   *clip,
+                                      GVariant                 *options,
+                                      const SubscriptionOption *extra,
+                                      GError                  **error)
+{
+  g_autoptr(ClippySubscription) sub = clippy_subscription_new (clip);
+  g_autoptr(GVariant) predicate = NULL;
+  g_autoptr(GVariant) params = NULL;
+  const gchar *key;
+  GVariantIter iter;
+  GVariant *value;
+
+  g_variant_iter_init (&iter, options);
+  while (g_variant_iter_loop (&iter, "{&sv}", &key, &value))
+    {
+      const SubscriptionOption *option = subscription_option_lookup (subscription_options, key);
+
+      if (!option)
+        option = subscription_option_lookup (extra, key);
+
+      clippy_return_val_if_fail (option,
+                                 NULL, error, CLIPPY_WRONG_OPTION,
+                                 "Unknown option '%s'",
+                                 key);
+
+      clippy_return_val_if_fail (g_variant_is_of_type (value, G_VARIANT_TYPE (option->type)),
+                                 NULL, error, CLIPPY_WRONG_OPTION,
+                                 "Option '%s' has type %s instead of %s",
+                                 key,
+                                 g_variant_get_type_string (value),
+                                 option->type);
+    }
+
+  if ((params = g_variant_lookup_value (options, "params", G_VARIANT_TYPE ("au"))))
+    {
+      const guint32 *indexes;
+      gsize n, i;
+
+      indexes = g_variant_get_fixed_array (params, &n, sizeof (guint32));
+
+      sub->params = 0;
+      for (i = 0; i < n; i++)
+        {
+          clippy_return_val_if_fail (indexes[i] < 64,
+                                     NULL, error, CLIPPY_WRONG_OPTION,
+                                     "Parameter index %u out of range",
+                                     indexes[i]);
+          sub->params |= G_GUINT64_CONSTANT (1) << indexes[i];
+        }
+    }
+
+  g_variant_lookup (options, "properties", "^as", &sub->properties);
+
+  if ((predicate = g_variant_lookup_value (options, "predicate", NULL)) &&
+      !(sub->predicate = clippy_predicate_new (predicate, error)))
+    return NULL;
+
+  g_variant_lookup (options, "edge", "b", &sub->edge);
+
+  return g_steal_pointer (&sub);
+}
+
 static void
 signal_closure_callback (void)
 {
   g_debug ("%s", __func__);
 }
 
+static GVariant *
+object_snapshot_properties (GObject *object, GStrv properties)
+{
+  GVariantBuilder builder;
+  gint i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+
+  for (i = 0; properties[i]; i++)
+    {
+      g_auto(GValue) value = G_VALUE_INIT;
+      g_autoptr(GError) error = NULL;
+
+      if (object_get_property_path (object, properties[i], &value, &error))
+        g_variant_builder_add (&builder, "{sv}", properties[i], variant_new_value (&value));
+      else
+        g_debug ("%s %s", __func__, error->message);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+/* Run a(sv) method calls in process, errors are only logged */
 static void
-signal_closure_marshall (GClosure     *closure,
-                         GValue       *return_value,
-                         guint         n_param_values,
-                         const GValue *param_values,
-                         gpointer      invocation_hint,
-                         gpointer      marshal_data)
+clippy_run_actions (Clippy *clip, GVariant *actions)
+{
+  GVariantIter iter;
+  const gchar *method;
+  GVariant *params;
+
+  g_variant_iter_init (&iter, actions);
+  while (g_variant_iter_loop (&iter, "(&sv)", &method, &params))
+    {
+      g_autoptr(GVariant) return_value = NULL;
+      g_autoptr(GError) error = NULL;
+
+      clippy_call (clip, method, params, &return_value, &error);
+
+      if (error)
+        g_warning ("Action %s failed: %s", method, error->message);
+    }
+}
+
+/*
+ * React in process to a subscription emission, right away in the emission
+ * that fired it. Returns TRUE if there is nothing to emit over D-Bus.
+ */
+static gboolean
+clippy_subscription_react (ClippySubscription *sub)
+{
+  /* Emission handed off from another thread after the lesson stopped */
+  if (sub->detached)
+    return TRUE;
+
+  if (sub->lesson)
+    {
+      clippy_lesson_step_done (sub->lesson, LESSON_OUTCOME_DONE);
+      return TRUE;
+    }
+
+  if (!sub->actions)
+    return FALSE;
+
+  /* Ignore emissions caused by our own actions, like a Set on the property
+   * whose notify fired the trigger, they would recurse without limit.
+   */
+  if (sub->running)
+    {
+      g_debug ("%s trigger %u ignoring its own emission", __func__, sub->trigger);
+      return TRUE;
+    }
+
+  g_debug ("%s trigger %u", __func__, sub->trigger);
+
+  sub->running = TRUE;
+  clippy_run_actions (sub->clip, sub->actions);
+  sub->running = FALSE;
+
+  clippy_emit_signal (sub->clip,
+                      CLIPPY_EVENT_PRIORITY_HIGH,
+                      NULL,
+                      "TriggerFired",
+                      "(u)",
+                      sub->trigger);
+  return TRUE;
+}
+
+static void
+clippy_emit_object_signal (ClippySubscription    *sub,
+                           GSignalInvocationHint *hint,
+                           guint                  n_param_values,
+                           const GValue          *param_values)
 {
-  Clippy *clip = marshal_data;
-  GSignalInvocationHint *hint = invocation_hint;
   GVariantBuilder builder;
-  GObject *object = NULL;
+  GObject *object = g_value_get_object (param_values);
+  GVariant *params;
+  guint n_params = 0;
   gint i;
-  
-  if (!n_param_values || !G_VALUE_HOLDS_OBJECT (param_values))
-    return;
-  
-  object = g_value_get_object (param_values);
 
   g_debug ("%s %s %s %s %d", __func__,
            G_OBJECT_TYPE_NAME (object), 
@@ -97,494 +430,4489 @@ signal_closure_marshall (GClosure     *closure,
            g_signal_name (hint->signal_id),
            n_param_values);
 
+  if (clippy_subscription_react (sub))
+    return;
+
   /*
    * DBus does not support maybe types or empty tuples this is why we
    * include the object name in the parameters tuple
    */
   g_variant_builder_init (&builder, G_VARIANT_TYPE_TUPLE);
       
-  /* Add extra parameters (including instance) */
-  for (i = 0; i < n_param_values; i++)
-    g_variant_builder_add_value (&builder, variant_new_value (&param_values[i]));
+  /* Add extra parameters (including instance), skipping unused ones */
+  for (i = 0; i < n_param_values && i < 64; i++)
+    {
+      if (!(sub->params & (G_GUINT64_CONSTANT (1) << i)))
+        continue;
+
+      g_variant_builder_add_value (&builder, variant_new_value (&param_values[i]));
+      n_params++;
+    }
+
+  /* Add properties snapshot, read now to be consistent with the event */
+  if (sub->properties)
+    {
+      g_variant_builder_add_value (&builder,
+                                   object_snapshot_properties (object, sub->properties));
+      n_params++;
+    }
+
+  /* Subscribers that only care about the emission get an empty array,
+   * DBus does not support empty tuples.
+   */
+  if (n_params)
+    params = g_variant_builder_end (&builder);
+  else
+    {
+      g_variant_builder_clear (&builder);
+      params = g_variant_new_array (G_VARIANT_TYPE_VARIANT, NULL, 0);
+    }
 
   /* Emit D-Bus signal */
-  clippy_emit_signal (clip,
-                      "ObjectSignal",
+  clippy_emit_signal (sub->clip,
+                      CLIPPY_EVENT_PRIORITY_LOW,
+                      NULL,
+                      "SequencedObjectSignal",
                       "(ssv)",
                       g_signal_name (hint->signal_id),
                       hint->detail ? g_quark_to_string (hint->detail) : "",
-                      g_variant_builder_end (&builder));
+                      params);
 }
 
 static void
-notify_closure_callback (GObject    *gobject,
-                         GParamSpec *pspec,
-                         Clippy     *clip)
+clippy_emit_object_notify (ClippySubscription *sub,
+                           GObject            *gobject,
+                           GParamSpec         *pspec)
 {
   const gchar *id  = object_get_name (gobject);
   g_auto(GValue) value = G_VALUE_INIT;
+  g_autofree gchar *key = NULL;
 
   g_debug ("%s %s %s", __func__, id, pspec->name);
   
   g_value_init (&value, pspec->value_type);
   g_object_get_property (gobject, pspec->name, &value);
 
-  /* Emit D-Bus signal */
-  clippy_emit_signal (clip,
-                      "ObjectNotify",
-                      "(ssv)",
-                      id,
-                      pspec->name,
-                      variant_new_value (&value));
-}
-
-static Clippy *
-clippy_new (GDBusConnection *connection)
-{
-  Clippy *clip = g_new0 (Clippy, 1);
-
-  clip->connection = g_object_ref (connection);
-  clip->provider = gtk_css_provider_new ();
-  gtk_css_provider_load_from_resource (clip->provider, "/com/endlessm/clippy/style.css");
-  gtk_style_context_add_provider_for_screen (gdk_screen_get_default (), 
-                                             GTK_STYLE_PROVIDER (clip->provider),
-                                             GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+  /* Evaluate predicate in process to avoid useless events */
+  if (sub->predicate)
+    {
+      gboolean matched = clippy_predicate_eval (sub->predicate, &value);
+      gboolean emit = matched && !(sub->edge && sub->matched);
 
-  /* id -> GtkWidget table */
-  clip->widgets = g_hash_table_new_full (g_str_hash,
-                                         g_str_equal,
-                                         g_free,
-                                         g_object_unref);
+      sub->matched = matched;
 
-  /* Message id -> GtkPopover table */
-  clip->messages = g_hash_table_new_full (g_str_hash,
-                                          g_str_equal,
-                                          g_free,
-                                          g_object_unref);
+      if (!emit)
+        return;
+    }
 
-  clip->signal_closure = g_cclosure_new (signal_closure_callback, NULL, NULL);
-  g_closure_set_marshal (clip->signal_closure, signal_closure_marshall);
-  g_closure_set_meta_marshal (clip->signal_closure, clip, signal_closure_marshall);
-  g_closure_ref (clip->signal_closure);
-  g_closure_sink (clip->signal_closure);
+  if (clippy_subscription_react (sub))
+    return;
 
-  clip->notify_closure = g_cclosure_new (G_CALLBACK (notify_closure_callback), clip, NULL);
-  g_closure_ref (clip->notify_closure);
-  g_closure_sink (clip->notify_closure);
-  
-  clip->manager = g_dbus_object_manager_server_new (DBUS_OBJECT_PATH);
-  g_dbus_object_manager_server_set_connection (clip->manager, connection);
+  /* Pending notifies for the same object property are merged, handles are
+   * never reused unlike addresses of finalized objects.
+   */
+  key = g_strdup_printf ("%s:%s", object_get_handle (gobject), pspec->name);
 
-  return clip;
+  /* Emit D-Bus signal */
+  clippy_emit_signal (sub->clip,
+                      CLIPPY_EVENT_PRIORITY_HIGH,
+                      key,
+                      "SequencedObjectNotify",
+                      "(ssv)",
+                      id ? id : "",
+                      pspec->name,
+                      pspec_variant_new_value (pspec, &value));
 }
 
 static void
-clippy_free (Clippy *clip)
+clippy_subscription_emit (ClippySubscription    *sub,
+                          GSignalInvocationHint *hint,
+                          guint                  n_param_values,
+                          const GValue          *param_values)
 {
-  gtk_style_context_remove_provider_for_screen (gdk_screen_get_default (),
-                                                GTK_STYLE_PROVIDER (clip->provider));
-  g_clear_object (&clip->connection);
-  g_clear_object (&clip->provider);
-  g_clear_object (&clip->manager);
-  g_clear_pointer (&clip->widgets, g_hash_table_unref);
-  g_clear_pointer (&clip->messages, g_hash_table_unref);
-  g_clear_pointer (&clip->signal_closure, g_closure_unref);
-  g_clear_pointer (&clip->notify_closure, g_closure_unref);
-  g_clear_pointer (&clip->css, g_free);
+  if (hint->signal_id == notify_signal_id)
+    clippy_emit_object_notify (sub,
+                               g_value_get_object (param_values),
+                               g_value_get_param (&param_values[1]));
+  else
+    clippy_emit_object_signal (sub, hint, n_param_values, param_values);
 }
 
+/* Signal emission captured on another thread */
+typedef struct _ClippyHandoff ClippyHandoff;
+
+struct _ClippyHandoff
+{
+  ClippyHandoff         *next;
+  ClippySubscription    *sub;     /* Reference, its owner might be gone */
+  GSignalInvocationHint  hint;
+  guint                  n_param_values;
+  GValue                 param_values[1];
+};
+
 static void
-clippy_timeout_add (GObject     *object,
-                    guint        timeout,
-                    GSourceFunc  function)
+clippy_handoff_free (ClippyHandoff *handoff)
 {
-  gpointer old_id;
-  guint id;
+  guint i;
 
-  if (!timeout)
-    return;
+  for (i = 0; i < handoff->n_param_values; i++)
+    g_value_unset (&handoff->param_values[i]);
 
-  /* Clear old timeout */
-  if ((old_id = g_object_get_data (object, CLIPPY_TIMEOUT_KEY)))
-    g_source_remove (GPOINTER_TO_UINT (old_id));
+  clippy_subscription_unref (handoff->sub);
+  g_free (handoff);
+}
 
-  /* Add new timeout */
-  id = g_timeout_add (timeout, function, object);
+static ClippyHandoff *
+clippy_handoff_steal (Clippy *clip)
+{
+  ClippyHandoff *list, *fifo = NULL, *next;
 
-  /* Save new timeout */
-  g_object_set_data (object, CLIPPY_TIMEOUT_KEY, GUINT_TO_POINTER (id));
+  do
+    list = g_atomic_pointer_get (&clip->handoff);
+  while (!g_atomic_pointer_compare_and_exchange (&clip->handoff, list, NULL));
+
+  /* Pushed as a stack, reverse it to get emission order */
+  for (; list; list = next)
+    {
+      next = list->next;
+      list->next = fifo;
+      fifo = list;
+    }
+
+  return fifo;
 }
 
+/*
+ * Emit every event captured on other threads, in the order they were
+ * captured. Runs in the main thread where name resolution and GVariant
+ * building are safe.
+ */
 static void
-clippy_timeout_remove (GObject *object, gboolean clear_source)
+clippy_handoff_drain (Clippy *clip)
 {
-  gpointer timeout;
+  ClippyHandoff *handoff, *next;
 
-  if (clear_source && (timeout = g_object_get_data (object, CLIPPY_TIMEOUT_KEY)))
-    g_source_remove (GPOINTER_TO_UINT (timeout));
+  if (!g_atomic_pointer_get (&clip->handoff))
+    return;
 
-  g_object_set_data (object, CLIPPY_TIMEOUT_KEY, NULL);
+  for (handoff = clippy_handoff_steal (clip); handoff; handoff = next)
+    {
+      next = handoff->next;
+      clippy_subscription_emit (handoff->sub,
+                                &handoff->hint,
+                                handoff->n_param_values,
+                                handoff->param_values);
+      clippy_handoff_free (handoff);
+    }
 }
 
 static gboolean
-clippy_highlight_clear (gpointer data)
+clippy_handoff_idle (gpointer data)
 {
-  clippy_timeout_remove (data, FALSE);
-  gtk_style_context_remove_class (gtk_widget_get_style_context (data),
-                                  HIGHLIGHT_CLASS);
+  clippy_handoff_drain (data);
   return G_SOURCE_REMOVE;
 }
 
+/*
+ * Capture the raw emission data and push it into a lock free stack, only the
+ * first push after a drain has to wake up the main thread.
+ */
 static void
-clippy_highlight (Clippy       *clip,
-                  const gchar  *object,
-                  guint         timeout,
-                  GError      **error)
+clippy_handoff_push (ClippySubscription    *sub,
+                     GSignalInvocationHint *hint,
+                     guint                  n_param_values,
+                     const GValue          *param_values)
 {
-  GObject *gobject;
-
-  /* Find widget */
-  if (!app_get_object_info (object, NULL, NULL,
-                            &gobject, NULL, NULL, error))
-    return;
+  Clippy *clip = sub->clip;
+  ClippyHandoff *handoff, *head;
+  guint i;
 
-  clippy_return_if_fail (GTK_IS_WIDGET (gobject),
-                         error, CLIPPY_NOT_A_WIDGET,
-                         "Object '%s' of type %s is not a GtkWidget",
-                         object,
-                         G_OBJECT_TYPE_NAME (gobject));
+  handoff = g_malloc0 (sizeof (ClippyHandoff) + (n_param_values - 1) * sizeof (GValue));
+  handoff->sub = clippy_subscription_ref (sub);
+  handoff->hint = *hint;
+  handoff->n_param_values = n_param_values;
 
-  /* Insert widget in table */
-  g_hash_table_insert (clip->widgets, g_strdup (object), g_object_ref (gobject));
+  for (i = 0; i < n_param_values; i++)
+    {
+      g_value_init (&handoff->param_values[i], G_VALUE_TYPE (&param_values[i]));
+      g_value_copy (&param_values[i], &handoff->param_values[i]);
+    }
 
-  g_debug ("%s %s %p", __func__, object, gobject);
+  do
+    {
+      head = g_atomic_pointer_get (&clip->handoff);
+      handoff->next = head;
+    }
+  while (!g_atomic_pointer_compare_and_exchange (&clip->handoff, head, handoff));
 
-  /* Highlight */
-  gtk_style_context_add_class (gtk_widget_get_style_context (GTK_WIDGET (gobject)),
-                               HIGHLIGHT_CLASS);
+  if (!head)
+    g_idle_add (clippy_handoff_idle, clip);
+}
 
-  clippy_timeout_add (gobject, timeout, clippy_highlight_clear);
+static void
+clippy_subscription_dispatch (ClippySubscription    *sub,
+                              GSignalInvocationHint *hint,
+                              guint                  n_param_values,
+                              const GValue          *param_values)
+{
+  if (g_thread_self () != sub->clip->thread)
+    {
+      clippy_handoff_push (sub, hint, n_param_values, param_values);
+      return;
+    }
+
+  /* Events from other threads happened before this one */
+  clippy_handoff_drain (sub->clip);
+
+  clippy_subscription_emit (sub, hint, n_param_values, param_values);
 }
 
 static void
-clippy_unhighlight (Clippy *clip, const gchar *object, GError **error)
+signal_closure_marshall (GClosure     *closure,
+                         GValue       *return_value,
+                         guint         n_param_values,
+                         const GValue *param_values,
+                         gpointer      invocation_hint,
+                         gpointer      marshal_data)
 {
-  GObject *gobject;
-
-  if (!app_get_object_info (object, NULL, NULL,
-                            &gobject, NULL, NULL, error))
+  if (!n_param_values || !G_VALUE_HOLDS_OBJECT (param_values))
     return;
 
-  clippy_timeout_remove (gobject, TRUE);
-
-  gtk_style_context_remove_class (gtk_widget_get_style_context (GTK_WIDGET (gobject)),
-                                  HIGHLIGHT_CLASS);
-  g_hash_table_remove (clip->widgets, object);
+  clippy_subscription_dispatch (marshal_data, invocation_hint,
+                                n_param_values, param_values);
 }
 
-static void
-on_popover_closed (GtkPopover *popover, Clippy *clip)
+static GClosure *
+clippy_subscription_closure_new (ClippySubscription *sub)
 {
-  const gchar *id;
+  GClosure *closure;
 
-  clippy_timeout_remove (G_OBJECT (popover), TRUE);
+  closure = g_cclosure_new (signal_closure_callback, NULL, NULL);
+  g_closure_set_marshal (closure, signal_closure_marshall);
+  g_closure_set_meta_marshal (closure, sub, signal_closure_marshall);
+  g_closure_add_finalize_notifier (closure, sub, (GClosureNotify) clippy_subscription_unref);
 
-  if ((id = gtk_widget_get_name (GTK_WIDGET (popover))))
-    {
-      clippy_emit_signal (clip, "MessageDone", "(s)", id);
-      g_hash_table_remove (clip->messages, id);
-    }
+  return closure;
 }
 
+typedef struct
+{
+  ClippySubscription *sub;
+  GType               type;     /* Instance type to filter emissions */
+  guint               signal_id;
+  gulong              hook_id;
+} ClippyTypeHook;
+
 static gboolean
-clippy_popover_clear (gpointer data)
+type_hook_emission (GSignalInvocationHint *hint,
+                    guint                  n_param_values,
+                    const GValue          *param_values,
+                    gpointer               data)
 {
-  clippy_timeout_remove (data, FALSE);
-  gtk_popover_popdown (data);
-  return G_SOURCE_REMOVE;
+  ClippyTypeHook *hook = data;
+  GObject *object;
+
+  if (!n_param_values || !G_VALUE_HOLDS_OBJECT (param_values))
+    return TRUE;
+
+  object = g_value_get_object (param_values);
+
+  /* Hooks are per signal, so we get emissions from every type that has it */
+  if (!g_type_is_a (G_OBJECT_TYPE (object), hook->type))
+    return TRUE;
+
+  clippy_subscription_dispatch (hook->sub, hint, n_param_values, param_values);
+
+  return TRUE;
 }
 
+/*
+ * GLib calls this once no emission runs the hook anymore, other threads
+ * might still be in type_hook_emission() when the hook is removed.
+ */
 static void
-clippy_message (Clippy       *clip,
-                const gchar  *id,
-                const gchar  *text,
-                const gchar  *image,
-                const gchar  *relative_to,
-                guint         timeout,
-                GError      **error)
+type_hook_destroy (ClippyTypeHook *hook)
 {
-  GtkWidget *box, *popover;
+  clippy_subscription_unref (hook->sub);
+  g_free (hook);
+}
 
-  if ((popover = g_hash_table_lookup (clip->messages, id)))
+static void
+type_hook_free (ClippyTypeHook *hook)
+{
+  /* Emissions already handed off to the main thread are ignored */
+  hook->sub->detached = TRUE;
+  g_signal_remove_emission_hook (hook->signal_id, hook->hook_id);
+}
+
+typedef enum
+{
+  TAP_BUTTON = 1 << 0,
+  TAP_KEY    = 1 << 1,
+  TAP_MOTION = 1 << 2
+} TapEvents;
+
+static const gchar *tap_event_names[] = { "button", "key", "motion", NULL };
+
+typedef struct
+{
+  Clippy    *clip;
+  gchar     *id;      /* Root object id */
+  GtkWidget *root;    /* Only events on this subtree are reported */
+  TapEvents  events;
+  GdkEvent  *motion;  /* Last motion event not reported yet */
+  guint      tick_id;
+} ClippyTap;
+
+static void
+clippy_tap_free (ClippyTap *tap)
+{
+  if (tap->tick_id)
+    gtk_widget_remove_tick_callback (tap->root, tap->tick_id);
+
+  g_clear_pointer (&tap->motion, gdk_event_free);
+  g_clear_object (&tap->root);
+  g_free (tap->id);
+  g_free (tap);
+}
+
+static void
+clippy_tap_emit (ClippyTap *tap, GdkEvent *event, GtkWidget *target)
+{
+  const gchar *id = object_get_name (G_OBJECT (target));
+  ClippyEventPriority priority = CLIPPY_EVENT_PRIORITY_HIGH;
+  const gchar *type, *name;
+  GVariantBuilder data;
+  gdouble x, y;
+
+  g_variant_builder_init (&data, G_VARIANT_TYPE_VARDICT);
+
+  if (gdk_event_get_root_coords (event, &x, &y))
     {
-      /* Reuse existing popover */
-      gtk_container_remove (GTK_CONTAINER (popover),
-                            gtk_bin_get_child (GTK_BIN (popover)));
+      g_variant_builder_add (&data, "{sv}", "x", g_variant_new_double (x));
+      g_variant_builder_add (&data, "{sv}", "y", g_variant_new_double (y));
     }
-  else
+
+  switch (event->type)
     {
-      GObject *gobject;
+      case GDK_BUTTON_PRESS:
+        type = "button";
+        g_variant_builder_add (&data, "{sv}", "button",
+                               g_variant_new_uint32 (event->button.button));
+        g_variant_builder_add (&data, "{sv}", "state",
+                               g_variant_new_uint32 (event->button.state));
+      break;
+      case GDK_KEY_PRESS:
+        type = "key";
+        name = gdk_keyval_name (event->key.keyval);
+        g_variant_builder_add (&data, "{sv}", "keyval",
+                               g_variant_new_uint32 (event->key.keyval));
+        g_variant_builder_add (&data, "{sv}", "name",
+                               g_variant_new_string (name ? name : ""));
+        g_variant_builder_add (&data, "{sv}", "state",
+                               g_variant_new_uint32 (event->key.state));
+      break;
+      default:
+        type = "motion";
+        priority = CLIPPY_EVENT_PRIORITY_LOW;
+      break;
+    }
 
-      if (!app_get_object_info (relative_to, NULL, NULL,
-                                &gobject, NULL, NULL, error))
-        return;
+  clippy_emit_signal (tap->clip, priority, NULL,
+                      "InputEvent", "(sss@a{sv})",
+                      tap->id,
+                      type,
+                      id ? id : "",
+                      g_variant_builder_end (&data));
+}
 
-      clippy_return_if_fail (GTK_IS_WIDGET (gobject),
-                             error, CLIPPY_NOT_A_WIDGET,
-                             "Object '%s' of type %s is not a GtkWidget",
-                             relative_to,
-                             G_OBJECT_TYPE_NAME (gobject));
+/* Report at most one motion sample per frame */
+static gboolean
+clippy_tap_tick (GtkWidget     *widget,
+                 GdkFrameClock *clock,
+                 gpointer       data)
+{
+  ClippyTap *tap = data;
+  GtkWidget *target;
 
-      /* Create new popover */
-      popover = gtk_popover_new (GTK_WIDGET (gobject));
-      gtk_widget_set_name (GTK_WIDGET (popover), id);
+  tap->tick_id = 0;
 
-      g_hash_table_insert (clip->messages,
-                           g_strdup (id),
-                           g_object_ref_sink (popover));
+  if (tap->motion && (target = gtk_get_event_widget (tap->motion)))
+    clippy_tap_emit (tap, tap->motion, target);
 
-      g_signal_connect (popover, "closed",
-                        G_CALLBACK (on_popover_closed),
-                        clip);
-    }
+  g_clear_pointer (&tap->motion, gdk_event_free);
 
-  box = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 8);
-  g_object_set (box, "margin", 8, NULL);
-  gtk_container_add (GTK_CONTAINER (popover), box);
+  return G_SOURCE_REMOVE;
+}
 
-  if (*image != '\0')
+static void
+clippy_tap_event (Clippy *clip, GdkEvent *event)
+{
+  GHashTableIter iter;
+  GtkWidget *target;
+  TapEvents mask;
+  ClippyTap *tap;
+
+  switch (event->type)
     {
-      GtkWidget *img = gtk_image_new ();
-      gtk_image_set_from_icon_name (GTK_IMAGE (img), image, GTK_ICON_SIZE_DIALOG);
-      gtk_box_pack_start (GTK_BOX (box), img, FALSE, TRUE, 0);
+      case GDK_BUTTON_PRESS:
+        mask = TAP_BUTTON;
+      break;
+      case GDK_KEY_PRESS:
+        mask = TAP_KEY;
+      break;
+      case GDK_MOTION_NOTIFY:
+        mask = TAP_MOTION;
+      break;
+      default:
+        return;
     }
 
-  if (*text != '\0')
+  if (!(target = gtk_get_event_widget (event)))
+    return;
+
+  /* Key events are delivered to the toplevel, report the focus widget */
+  if (mask == TAP_KEY && GTK_IS_WINDOW (target) &&
+      gtk_window_get_focus (GTK_WINDOW (target)))
+    target = gtk_window_get_focus (GTK_WINDOW (target));
+
+  g_hash_table_iter_init (&iter, clip->taps);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &tap))
     {
-      GtkWidget *label = gtk_label_new (text);
-      gtk_label_set_use_markup (GTK_LABEL (label), TRUE);
-      gtk_box_pack_start (GTK_BOX (box), label, TRUE, TRUE, 0);
-    }
+      if (!(tap->events & mask) ||
+          (target != tap->root && !gtk_widget_is_ancestor (target, tap->root)))
+        continue;
 
-  clippy_timeout_add (G_OBJECT(popover), timeout, clippy_popover_clear);
+      if (mask != TAP_MOTION)
+        {
+          clippy_tap_emit (tap, event, target);
+          continue;
+        }
 
-  gtk_widget_show_all (box);
-  gtk_popover_popup (GTK_POPOVER (popover));
+      /* Coalesce motion, keeping only the last sample of the frame */
+      g_clear_pointer (&tap->motion, gdk_event_free);
+      tap->motion = gdk_event_copy (event);
+
+      if (!tap->tick_id)
+        tap->tick_id = gtk_widget_add_tick_callback (tap->root, clippy_tap_tick, tap, NULL);
+    }
 }
 
 static void
-clippy_message_clear (Clippy *clip, const gchar *id, GError **error)
+clippy_event_handler (GdkEvent *event, gpointer data)
 {
-  GtkWidget *popover;
+  Clippy *clip = data;
 
-  clippy_return_if_fail ((popover = g_hash_table_lookup (clip->messages, id)),
-                         error, CLIPPY_WRONG_MSG_ID,
-                         "Message id '%s' not found",
-                         id);
+  if (g_hash_table_size (clip->taps))
+    clippy_tap_event (clip, event);
 
-  gtk_popover_popdown (GTK_POPOVER (popover));
+  gtk_main_do_event (event);
 }
 
 static void
-clippy_set (Clippy       *clip,
-            const gchar  *object,
-            const gchar  *property,
-            GVariant     *variant,
-            GError      **error)
+on_event_handler_replaced (gpointer data)
 {
-  g_auto(GValue) gvalue = G_VALUE_INIT;
-  GObject *gobject;
-  GParamSpec *pspec;
-  
-  g_debug ("%s %s %s", __func__, object, property);
-  
-  if (!app_get_object_info (object, property, NULL,
-                            &gobject, &pspec, NULL, error))
-    return;
+  Clippy *clip = data;
 
-  g_value_init (&gvalue, pspec->value_type);
-  value_set_variant (&gvalue, variant);
+  clip->event_handler = FALSE;
+}
 
-  g_object_set_property (gobject, property, &gvalue);
+/*
+ * GDK has a single event handler and no way to get the current one, so ours
+ * is only installed while there are taps, chaining to gtk_main_do_event() like
+ * the default one. It is put back when the last tap goes away, unless someone
+ * else replaced ours in the meantime.
+ */
+static void
+clippy_event_handler_update (Clippy *clip)
+{
+  gboolean needed = clip->taps && g_hash_table_size (clip->taps);
+
+  if (needed && !clip->event_handler)
+    {
+      gdk_event_handler_set (clippy_event_handler, clip, on_event_handler_replaced);
+      clip->event_handler = TRUE;
+    }
+  else if (!needed && clip->event_handler)
+    gdk_event_handler_set ((GdkEventFunc) gtk_main_do_event, NULL, NULL);
 }
 
 static void
-clippy_get (Clippy       *clip,
-            const gchar  *object,
-            const gchar  *property,
-            GVariant    **return_value,
-            GError      **error)
+clippy_tap_input (Clippy       *clip,
+                  const gchar  *object,
+                  const gchar **events,
+                  GError      **error)
 {
-  g_auto(GValue) gvalue = G_VALUE_INIT;
+  TapEvents mask = 0;
+  ClippyTap *tap;
   GObject *gobject;
-  GParamSpec *pspec;
-  
-  g_debug ("%s %s %s", __func__, object, property);
+  gint i, j;
 
-  if (!app_get_object_info (object, property, NULL,
-                            &gobject, &pspec, NULL, error))
+  g_debug ("%s %s", __func__, object);
+
+  if (!app_get_object_info (object, NULL, NULL, &gobject, NULL, NULL, error))
     return;
 
-  g_value_init (&gvalue, pspec->value_type);
-  g_object_get_property (gobject, property, &gvalue);
+  clippy_return_if_fail (GTK_IS_WIDGET (gobject),
+                         error, CLIPPY_NOT_A_WIDGET,
+                         "Object '%s' of type %s is not a GtkWidget",
+                         object,
+                         G_OBJECT_TYPE_NAME (gobject));
 
-  if (return_value)
-    *return_value = g_variant_new ("(v)", variant_new_value (&gvalue));
+  for (i = 0; events[i]; i++)
+    {
+      for (j = 0; tap_event_names[j]; j++)
+        if (g_strcmp0 (events[i], tap_event_names[j]) == 0)
+          break;
+
+      clippy_return_if_fail (tap_event_names[j],
+                             error, CLIPPY_WRONG_OPTION,
+                             "Unknown input event type '%s'",
+                             events[i]);
+      mask |= 1 << j;
+    }
+
+  tap = g_new0 (ClippyTap, 1);
+  tap->clip = clip;
+  tap->id = g_strdup (object);
+  tap->root = g_object_ref (GTK_WIDGET (gobject));
+  tap->events = mask;
+
+  g_hash_table_replace (clip->taps, tap->id, tap);
+
+  /* All events go through the handler, filter them before GTK gets them */
+  clippy_event_handler_update (clip);
 }
 
 static void
-clippy_connect (Clippy       *clip,
-                const gchar  *object,
-                const gchar  *signal,
-                const gchar  *detail,
-                GError      **error)
+clippy_untap_input (Clippy *clip, const gchar *object, GError **error)
 {
-  GObject *gobject;
-  GClosure *closure;
-  gboolean notify;
-  GQuark quark;
-  guint id;
+  g_debug ("%s %s", __func__, object);
 
-  g_debug ("%s %s %s %s", __func__, object, signal, detail ? detail : "null");
+  clippy_return_if_fail (g_hash_table_remove (clip->taps, object),
+                         error, CLIPPY_NO_OBJECT,
+                         "No input tap on object '%s'",
+                         object);
 
-  if (!app_get_object_info (object, NULL, signal,
-                            &gobject, NULL, &id, error))
-    return;
+  clippy_event_handler_update (clip);
+}
 
-  notify = g_strcmp0 (signal, "notify") == 0;
-  quark = g_quark_from_string (detail);
-  
-  if (notify)
-    clippy_return_if_fail (quark,
-                           error, CLIPPY_NO_DETAIL,
-                           "Notify signal for object '%s' requieres detail (property)",
-                           object);
-  
-  closure = (notify) ? clip->notify_closure : clip->signal_closure;
-  g_signal_connect_closure_by_id (gobject, id, quark, closure, FALSE);
+typedef struct
+{
+  Clippy        *clip;
+  gchar         *id;
+  GtkWidget     *widget;
+  GdkFrameClock *clock;          /* Clock we are waiting to paint */
+  gulong         after_paint_id;
+  guint          idle_id;
+  guint          timeout_id;
+
+  /* Last state reported */
+  gboolean       mapped, visible;
+  GdkRectangle   rect;
+  GdkRectangle   visible_rect;
+} ClippyGeometryWatch;
+
+/*
+ * Get @widget allocation in @toplevel coordinates and the part of it that is
+ * on screen, clipped by every ancestor, for example a scrolled window.
+ */
+static void
+widget_get_toplevel_rects (GtkWidget    *widget,
+                           GtkWidget    *toplevel,
+                           GdkRectangle *rect,
+                           GdkRectangle *visible_rect)
+{
+  GtkAllocation alloc;
+  GtkWidget *parent;
+
+  gtk_widget_get_allocation (widget, &alloc);
+  rect->width = alloc.width;
+  rect->height = alloc.height;
+
+  if (!gtk_widget_translate_coordinates (widget, toplevel, 0, 0, &rect->x, &rect->y))
+    rect->x = rect->y = 0;
+
+  *visible_rect = *rect;
+
+  if (!gtk_widget_is_drawable (widget))
+    {
+      visible_rect->width = visible_rect->height = 0;
+      return;
+    }
+
+  for (parent = gtk_widget_get_parent (widget); parent; parent = gtk_widget_get_parent (parent))
+    {
+      GdkRectangle clip;
+
+      gtk_widget_get_allocation (parent, &alloc);
+      clip.width = alloc.width;
+      clip.height = alloc.height;
+
+      if (!gtk_widget_translate_coordinates (parent, toplevel, 0, 0, &clip.x, &clip.y) ||
+          !gdk_rectangle_intersect (visible_rect, &clip, visible_rect))
+        {
+          visible_rect->x = visible_rect->y = 0;
+          visible_rect->width = visible_rect->height = 0;
+          return;
+        }
+    }
 }
 
 static void
-clippy_emit (Clippy       *clip,
-             const gchar  *signal,
-             const gchar  *detail,
-             GVariant     *params,
-             GError      **error)
+geometry_watch_flush (ClippyGeometryWatch *watch)
 {
-  g_autoptr(GVariant) variant = NULL;
-  const gchar *object;
-  GSignalQuery query;
-  GObject *gobject;
-  guint id;
+  GtkWidget *toplevel = gtk_widget_get_toplevel (watch->widget);
+  GdkRectangle rect, visible_rect;
+  gboolean mapped, visible;
 
-  if (!params ||
-      !(variant = g_variant_get_child_value (params, 0)) ||
-      !(object = g_variant_get_string (variant, NULL)) ||
-      !app_get_object_info (object, NULL, signal,
-                            &gobject, NULL, &id, error))
+  if (watch->after_paint_id)
+    {
+      g_signal_handler_disconnect (watch->clock, watch->after_paint_id);
+      watch->after_paint_id = 0;
+    }
+
+  if (watch->timeout_id)
+    {
+      g_source_remove (watch->timeout_id);
+      watch->timeout_id = 0;
+    }
+
+  g_clear_object (&watch->clock);
+
+  mapped = gtk_widget_get_mapped (watch->widget);
+  visible = gtk_widget_get_visible (watch->widget);
+
+  widget_get_toplevel_rects (watch->widget, toplevel, &rect, &visible_rect);
+
+  /* Nothing changed since last report */
+  if (mapped == watch->mapped && visible == watch->visible &&
+      gdk_rectangle_equal (&rect, &watch->rect) &&
+      gdk_rectangle_equal (&visible_rect, &watch->visible_rect))
     return;
 
-  g_signal_query (id, &query);
+  watch->mapped = mapped;
+  watch->visible = visible;
+  watch->rect = rect;
+  watch->visible_rect = visible_rect;
+
+  clippy_emit_signal (watch->clip, CLIPPY_EVENT_PRIORITY_HIGH, NULL,
+                      "GeometryChanged", "(sbb(iiii)(iiii))",
+                      watch->id,
+                      mapped,
+                      visible,
+                      rect.x, rect.y, rect.width, rect.height,
+                      visible_rect.x, visible_rect.y,
+                      visible_rect.width, visible_rect.height);
+}
+
+static gboolean
+geometry_watch_idle (gpointer data)
+{
+  ClippyGeometryWatch *watch = data;
+
+  watch->idle_id = 0;
+  geometry_watch_flush (watch);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+geometry_watch_timeout (gpointer data)
+{
+  ClippyGeometryWatch *watch = data;
+
+  watch->timeout_id = 0;
+  geometry_watch_flush (watch);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Changes are reported once per frame, after layout and paint, or from an
+ * idle if the toplevel is not mapped since its clock will not tick.
+ */
+static void
+geometry_watch_queue (ClippyGeometryWatch *watch)
+{
+  GtkWidget *toplevel = gtk_widget_get_toplevel (watch->widget);
+  GdkFrameClock *clock;
+
+  if (watch->after_paint_id || watch->idle_id)
+    return;
+
+  if (gtk_widget_get_mapped (toplevel) &&
+      (clock = gtk_widget_get_frame_clock (toplevel)))
+    {
+      watch->clock = g_object_ref (clock);
+      watch->after_paint_id = g_signal_connect_swapped (clock, "after-paint",
+                                                        G_CALLBACK (geometry_watch_flush),
+                                                        watch);
+      gdk_frame_clock_request_phase (clock, GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
+      watch->timeout_id = g_timeout_add (FRAME_FLUSH_TIMEOUT, geometry_watch_timeout, watch);
+    }
+  else
+    watch->idle_id = g_idle_add (geometry_watch_idle, watch);
+}
+
+static void
+geometry_watch_free (ClippyGeometryWatch *watch)
+{
+  g_signal_handlers_disconnect_by_data (watch->widget, watch);
+
+  if (watch->after_paint_id)
+    g_signal_handler_disconnect (watch->clock, watch->after_paint_id);
+
+  if (watch->idle_id)
+    g_source_remove (watch->idle_id);
+
+  if (watch->timeout_id)
+    g_source_remove (watch->timeout_id);
+
+  g_clear_object (&watch->clock);
+  g_clear_object (&watch->widget);
+  g_free (watch->id);
+  g_free (watch);
+}
+
+typedef enum
+{
+  TREE_DELTA_NONE,
+  TREE_DELTA_ADDED,
+  TREE_DELTA_REMOVED,
+  TREE_DELTA_REPARENTED
+} TreeDeltaState;
+
+typedef struct
+{
+  GtkWidget      *widget;     /* Reference held until flushed */
+  TreeDeltaState  state;
+  gchar          *old_parent; /* Parent id when removed */
+  guint64         changed;    /* Mask of changed properties */
+} TreeDelta;
+
+typedef struct
+{
+  Clippy        *clip;
+  guint          id;
+  GtkWidget     *root;
+  GStrv          properties;
+  GHashTable    *deltas;  /* GtkWidget -> TreeDelta */
+  GdkFrameClock *clock;   /* Clock we are waiting to paint */
+  gulong         after_paint_id;
+  gulong         destroy_id;
+  guint          idle_id;
+  guint          timeout_id;
+} ClippyTreeSub;
+
+static void
+tree_delta_free (TreeDelta *delta)
+{
+  g_object_unref (delta->widget);
+  g_free (delta->old_parent);
+  g_free (delta);
+}
+
+static gboolean
+tree_sub_contains (ClippyTreeSub *sub, GtkWidget *widget)
+{
+  return widget == sub->root || gtk_widget_is_ancestor (widget, sub->root);
+}
+
+static GVariant *
+tree_sub_properties (ClippyTreeSub *sub, GtkWidget *widget, guint64 mask)
+{
+  GVariantBuilder builder;
+  gint i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+
+  for (i = 0; i < 64 && sub->properties[i]; i++)
+    {
+      g_auto(GValue) value = G_VALUE_INIT;
+
+      if (!(mask & (G_GUINT64_CONSTANT (1) << i)))
+        continue;
+
+      if (object_get_property_path (G_OBJECT (widget), sub->properties[i], &value, NULL))
+        g_variant_builder_add (&builder, "{sv}", sub->properties[i], variant_new_value (&value));
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+static void
+tree_sub_add_delta (ClippyTreeSub   *sub,
+                    GVariantBuilder *builder,
+                    const gchar     *op,
+                    GtkWidget       *widget,
+                    const gchar     *parent,
+                    guint64          mask)
+{
+  g_variant_builder_add (builder, "(sss@a{sv})",
+                         op,
+                         object_get_id (G_OBJECT (widget)),
+                         parent ? parent : "",
+                         tree_sub_properties (sub, widget, mask));
+}
+
+typedef struct
+{
+  ClippyTreeSub   *sub;
+  GVariantBuilder *builder;
+} TreeAddData;
+
+/* Report @widget descendants too, they are added to the tree with it */
+static void
+tree_sub_add_forall (GtkWidget *widget, gpointer user_data)
+{
+  TreeAddData *data = user_data;
+  GtkWidget *parent = gtk_widget_get_parent (widget);
+
+  tree_sub_add_delta (data->sub, data->builder, "added", widget,
+                      parent ? object_get_id (G_OBJECT (parent)) : NULL,
+                      SUBSCRIPTION_ALL_PARAMS);
+
+  if (GTK_IS_CONTAINER (widget))
+    gtk_container_forall (GTK_CONTAINER (widget), tree_sub_add_forall, data);
+}
+
+/* Added nodes with an added ancestor are reported by the ancestor */
+static gboolean
+tree_sub_ancestor_added (ClippyTreeSub *sub, GtkWidget *widget)
+{
+  GtkWidget *parent;
+
+  for (parent = gtk_widget_get_parent (widget); parent; parent = gtk_widget_get_parent (parent))
+    {
+      TreeDelta *delta = g_hash_table_lookup (sub->deltas, parent);
+
+      if (delta && delta->state == TREE_DELTA_ADDED)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+tree_sub_flush (ClippyTreeSub *sub)
+{
+  static const TreeDeltaState order[] = {
+    TREE_DELTA_REMOVED, TREE_DELTA_ADDED, TREE_DELTA_REPARENTED, TREE_DELTA_NONE
+  };
+  GVariantBuilder builder;
+  TreeAddData data = { sub, &builder };
+  guint i;
+
+  if (sub->after_paint_id)
+    {
+      g_signal_handler_disconnect (sub->clock, sub->after_paint_id);
+      sub->after_paint_id = 0;
+    }
+
+  if (sub->timeout_id)
+    {
+      g_source_remove (sub->timeout_id);
+      sub->timeout_id = 0;
+    }
+
+  g_clear_object (&sub->clock);
+
+  if (!g_hash_table_size (sub->deltas))
+    return;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sssa{sv})"));
+
+  /* Removed first, parents before children and property changes last */
+  for (i = 0; i < G_N_ELEMENTS (order); i++)
+    {
+      GHashTableIter iter;
+      TreeDelta *delta;
+
+      g_hash_table_iter_init (&iter, sub->deltas);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &delta))
+        {
+          GtkWidget *parent = gtk_widget_get_parent (delta->widget);
+          const gchar *parent_id = parent ? object_get_id (G_OBJECT (parent)) : NULL;
+
+          if (delta->state != order[i])
+            continue;
+
+          switch (delta->state)
+            {
+            case TREE_DELTA_REMOVED:
+              tree_sub_add_delta (sub, &builder, "removed", delta->widget, delta->old_parent, 0);
+              break;
+            case TREE_DELTA_ADDED:
+              if (tree_sub_ancestor_added (sub, delta->widget))
+                break;
+
+              tree_sub_add_delta (sub, &builder, "added", delta->widget, parent_id,
+                                  SUBSCRIPTION_ALL_PARAMS);
+              if (GTK_IS_CONTAINER (delta->widget))
+                gtk_container_forall (GTK_CONTAINER (delta->widget), tree_sub_add_forall, &data);
+              break;
+            case TREE_DELTA_REPARENTED:
+              tree_sub_add_delta (sub, &builder, "reparented", delta->widget, parent_id,
+                                  delta->changed);
+              break;
+            case TREE_DELTA_NONE:
+              tree_sub_add_delta (sub, &builder, "changed", delta->widget, NULL, delta->changed);
+              break;
+            }
+        }
+    }
+
+  g_hash_table_remove_all (sub->deltas);
+
+  clippy_emit_signal (sub->clip, CLIPPY_EVENT_PRIORITY_HIGH, NULL,
+                      "TreeChanged", "(ua(sssa{sv}))",
+                      sub->id,
+                      &builder);
+}
+
+static gboolean
+tree_sub_idle (gpointer data)
+{
+  ClippyTreeSub *sub = data;
+
+  sub->idle_id = 0;
+  tree_sub_flush (sub);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+tree_sub_timeout (gpointer data)
+{
+  ClippyTreeSub *sub = data;
+
+  sub->timeout_id = 0;
+  tree_sub_flush (sub);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Deltas are batched and reported once per frame, like geometry changes */
+static void
+tree_sub_queue (ClippyTreeSub *sub)
+{
+  GtkWidget *toplevel = gtk_widget_get_toplevel (sub->root);
+  GdkFrameClock *clock;
+
+  if (sub->after_paint_id || sub->idle_id)
+    return;
+
+  if (gtk_widget_get_mapped (toplevel) &&
+      (clock = gtk_widget_get_frame_clock (toplevel)))
+    {
+      sub->clock = g_object_ref (clock);
+      sub->after_paint_id = g_signal_connect_swapped (clock, "after-paint",
+                                                      G_CALLBACK (tree_sub_flush),
+                                                      sub);
+      gdk_frame_clock_request_phase (clock, GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
+      sub->timeout_id = g_timeout_add (FRAME_FLUSH_TIMEOUT, tree_sub_timeout, sub);
+    }
+  else
+    sub->idle_id = g_idle_add (tree_sub_idle, sub);
+}
+
+static TreeDelta *
+tree_sub_get_delta (ClippyTreeSub *sub, GtkWidget *widget)
+{
+  TreeDelta *delta;
+
+  if (!(delta = g_hash_table_lookup (sub->deltas, widget)))
+    {
+      delta = g_new0 (TreeDelta, 1);
+      delta->widget = g_object_ref (widget);
+      g_hash_table_insert (sub->deltas, widget, delta);
+    }
+
+  tree_sub_queue (sub);
+
+  return delta;
+}
+
+static void
+tree_sub_parent_set (ClippyTreeSub *sub, GtkWidget *widget, GtkWidget *old_parent)
+{
+  gboolean was_in = old_parent && tree_sub_contains (sub, old_parent);
+  gboolean is_in = gtk_widget_get_parent (widget) && tree_sub_contains (sub, widget);
+  TreeDelta *delta;
+
+  if (!was_in && !is_in)
+    return;
+
+  delta = tree_sub_get_delta (sub, widget);
+
+  if (was_in && !is_in)
+    {
+      /* Added and removed in the same frame, nothing to report */
+      if (delta->state == TREE_DELTA_ADDED)
+        {
+          g_hash_table_remove (sub->deltas, widget);
+          return;
+        }
+
+      if (delta->state != TREE_DELTA_REPARENTED)
+        delta->old_parent = g_strdup (object_get_id (G_OBJECT (old_parent)));
+
+      delta->state = TREE_DELTA_REMOVED;
+    }
+  else if (!was_in && is_in)
+    delta->state = (delta->state == TREE_DELTA_REMOVED) ? TREE_DELTA_REPARENTED : TREE_DELTA_ADDED;
+  else if (delta->state != TREE_DELTA_ADDED)
+    delta->state = TREE_DELTA_REPARENTED;
+}
+
+static void
+tree_sub_notify (ClippyTreeSub *sub, GtkWidget *widget, GParamSpec *pspec)
+{
+  gint i;
+
+  if (!tree_sub_contains (sub, widget))
+    return;
+
+  for (i = 0; i < 64 && sub->properties[i]; i++)
+    {
+      if (g_strcmp0 (sub->properties[i], pspec->name))
+        continue;
+
+      tree_sub_get_delta (sub, widget)->changed |= G_GUINT64_CONSTANT (1) << i;
+      return;
+    }
+}
+
+static void
+tree_sub_free (ClippyTreeSub *sub)
+{
+  if (sub->after_paint_id)
+    g_signal_handler_disconnect (sub->clock, sub->after_paint_id);
+
+  if (sub->idle_id)
+    g_source_remove (sub->idle_id);
+
+  if (sub->timeout_id)
+    g_source_remove (sub->timeout_id);
+
+  g_signal_handler_disconnect (sub->root, sub->destroy_id);
+
+  g_clear_object (&sub->clock);
+  g_hash_table_unref (sub->deltas);
+  g_strfreev (sub->properties);
+  g_object_unref (sub->root);
+  g_free (sub);
+}
+
+typedef struct
+{
+  guint position;
+  guint removed;
+  guint added;
+} RowsChange;
+
+typedef struct
+{
+  Clippy  *clip;
+  gchar   *id;
+  GObject *model;   /* GtkTreeModel or GListModel */
+  GArray  *changes; /* RowsChange list, in emission order */
+  guint    idle_id;
+} ClippyRowsWatch;
+
+static gboolean
+rows_watch_flush (gpointer data)
+{
+  ClippyRowsWatch *watch = data;
+  GVariantBuilder builder;
+  guint i;
+
+  watch->idle_id = 0;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(uuu)"));
+
+  for (i = 0; i < watch->changes->len; i++)
+    {
+      RowsChange *change = &g_array_index (watch->changes, RowsChange, i);
+      g_variant_builder_add (&builder, "(uuu)", change->position, change->removed, change->added);
+    }
+
+  g_array_set_size (watch->changes, 0);
+
+  clippy_emit_signal (watch->clip, CLIPPY_EVENT_PRIORITY_HIGH, NULL,
+                      "RowsChanged", "(sa(uuu))",
+                      watch->id,
+                      &builder);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Changes use GListModel::items-changed semantics, each one applies to the
+ * model as left by the previous one. Runs of updates, insertions or
+ * deletions, which is what bulk model operations produce, are merged.
+ */
+static void
+rows_watch_add (ClippyRowsWatch *watch, guint position, guint removed, guint added)
+{
+  RowsChange *last = NULL, change = { position, removed, added };
+
+  if (!removed && !added)
+    return;
+
+  if (watch->changes->len)
+    last = &g_array_index (watch->changes, RowsChange, watch->changes->len - 1);
+
+  if (last && removed == added && last->removed == last->added &&
+      position >= last->position && position <= last->position + last->added)
+    last->removed = last->added = MAX (last->position + last->added, position + added) - last->position;
+  else if (last && !removed && !last->removed &&
+           position >= last->position && position <= last->position + last->added)
+    last->added += added;
+  else if (last && !added && !last->added &&
+           (position == last->position || position + removed == last->position))
+    {
+      last->position = position;
+      last->removed += removed;
+    }
+  else
+    g_array_append_val (watch->changes, change);
+
+  if (!watch->idle_id)
+    watch->idle_id = g_idle_add (rows_watch_flush, watch);
+}
+
+static void
+on_rows_items_changed (GListModel      *model,
+                       guint            position,
+                       guint            removed,
+                       guint            added,
+                       ClippyRowsWatch *watch)
+{
+  rows_watch_add (watch, position, removed, added);
+}
+
+/* Only top level rows are paged, nested changes update their top level row */
+static void
+on_rows_row_changed (GtkTreeModel    *model,
+                     GtkTreePath     *path,
+                     GtkTreeIter     *iter,
+                     ClippyRowsWatch *watch)
+{
+  if (gtk_tree_path_get_depth (path))
+    rows_watch_add (watch, gtk_tree_path_get_indices (path)[0], 1, 1);
+}
+
+static void
+on_rows_row_inserted (GtkTreeModel    *model,
+                      GtkTreePath     *path,
+                      GtkTreeIter     *iter,
+                      ClippyRowsWatch *watch)
+{
+  if (gtk_tree_path_get_depth (path) == 1)
+    rows_watch_add (watch, gtk_tree_path_get_indices (path)[0], 0, 1);
+  else
+    on_rows_row_changed (model, path, iter, watch);
+}
+
+static void
+on_rows_row_deleted (GtkTreeModel    *model,
+                     GtkTreePath     *path,
+                     ClippyRowsWatch *watch)
+{
+  if (gtk_tree_path_get_depth (path) == 1)
+    rows_watch_add (watch, gtk_tree_path_get_indices (path)[0], 1, 0);
+  else
+    on_rows_row_changed (model, path, NULL, watch);
+}
+
+static void
+on_rows_rows_reordered (GtkTreeModel    *model,
+                        GtkTreePath     *path,
+                        GtkTreeIter     *iter,
+                        gpointer         new_order,
+                        ClippyRowsWatch *watch)
+{
+  guint n_rows;
+
+  if (gtk_tree_path_get_depth (path))
+    on_rows_row_changed (model, path, iter, watch);
+  else if ((n_rows = gtk_tree_model_iter_n_children (model, NULL)))
+    rows_watch_add (watch, 0, n_rows, n_rows);
+}
+
+static void
+rows_watch_free (ClippyRowsWatch *watch)
+{
+  g_signal_handlers_disconnect_by_data (watch->model, watch);
+
+  if (watch->idle_id)
+    g_source_remove (watch->idle_id);
+
+  g_array_unref (watch->changes);
+  g_object_unref (watch->model);
+  g_free (watch->id);
+  g_free (watch);
+}
+
+typedef struct
+{
+  gint     offset;  /* Character offset */
+  gint     removed; /* Characters removed at offset */
+  GString *text;    /* Text inserted at offset */
+  gint     n_chars; /* Characters in text */
+} TextDelta;
+
+typedef struct
+{
+  Clippy        *clip;
+  gchar         *id;
+  GtkTextBuffer *buffer;
+  GtkWidget     *view;    /* Text view used for its frame clock, if any */
+  GArray        *deltas;  /* TextDelta list, in emission order */
+  GdkFrameClock *clock;   /* Clock we are waiting to paint */
+  gulong         after_paint_id;
+  guint          idle_id;
+  guint          timeout_id;
+  gint           removing; /* Characters the current delete-range removes */
+} ClippyTextWatch;
+
+static void
+text_delta_clear (TextDelta *delta)
+{
+  g_string_free (delta->text, TRUE);
+}
+
+static void
+text_watch_flush (ClippyTextWatch *watch)
+{
+  GVariantBuilder builder;
+  guint i;
+
+  if (watch->after_paint_id)
+    {
+      g_signal_handler_disconnect (watch->clock, watch->after_paint_id);
+      watch->after_paint_id = 0;
+    }
+
+  if (watch->timeout_id)
+    {
+      g_source_remove (watch->timeout_id);
+      watch->timeout_id = 0;
+    }
+
+  g_clear_object (&watch->clock);
+
+  if (!watch->deltas->len)
+    return;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(iis)"));
+
+  for (i = 0; i < watch->deltas->len; i++)
+    {
+      TextDelta *delta = &g_array_index (watch->deltas, TextDelta, i);
+      g_variant_builder_add (&builder, "(iis)", delta->offset, delta->removed, delta->text->str);
+    }
+
+  g_array_set_size (watch->deltas, 0);
+
+  clippy_emit_signal (watch->clip, CLIPPY_EVENT_PRIORITY_HIGH, NULL,
+                      "TextChanged", "(sa(iis))",
+                      watch->id,
+                      &builder);
+}
+
+static gboolean
+text_watch_idle (gpointer data)
+{
+  ClippyTextWatch *watch = data;
+
+  watch->idle_id = 0;
+  text_watch_flush (watch);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+text_watch_timeout (gpointer data)
+{
+  ClippyTextWatch *watch = data;
+
+  watch->timeout_id = 0;
+  text_watch_flush (watch);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Deltas are reported once per frame of the text view, or from an idle */
+static void
+text_watch_queue (ClippyTextWatch *watch)
+{
+  GdkFrameClock *clock;
+
+  if (watch->after_paint_id || watch->idle_id)
+    return;
+
+  if (watch->view &&
+      gtk_widget_get_mapped (gtk_widget_get_toplevel (watch->view)) &&
+      (clock = gtk_widget_get_frame_clock (watch->view)))
+    {
+      watch->clock = g_object_ref (clock);
+      watch->after_paint_id = g_signal_connect_swapped (clock, "after-paint",
+                                                        G_CALLBACK (text_watch_flush),
+                                                        watch);
+      gdk_frame_clock_request_phase (clock, GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
+      watch->timeout_id = g_timeout_add (FRAME_FLUSH_TIMEOUT, text_watch_timeout, watch);
+    }
+  else
+    watch->idle_id = g_idle_add (text_watch_idle, watch);
+}
+
+static TextDelta *
+text_watch_last (ClippyTextWatch *watch)
+{
+  if (!watch->deltas->len)
+    return NULL;
+
+  return &g_array_index (watch->deltas, TextDelta, watch->deltas->len - 1);
+}
+
+/*
+ * Edits are recorded after the default handler, so handlers stopping the
+ * emission do not report changes that never happened. Iters point to the
+ * new content by then.
+ */
+static void
+on_text_insert_text (GtkTextBuffer   *buffer,
+                     GtkTextIter     *location,
+                     const gchar     *text,
+                     gint             len,
+                     ClippyTextWatch *watch)
+{
+  gint n_chars = g_utf8_strlen (text, len);
+  gint offset = gtk_text_iter_get_offset (location) - n_chars;
+  TextDelta *last = text_watch_last (watch);
+
+  /* Typing appends to the previous delta */
+  if (last && offset == last->offset + last->n_chars)
+    {
+      g_string_append_len (last->text, text, len);
+      last->n_chars += n_chars;
+    }
+  else
+    {
+      TextDelta delta = { offset, 0, g_string_new_len (text, len), n_chars };
+      g_array_append_val (watch->deltas, delta);
+    }
+
+  text_watch_queue (watch);
+}
+
+/* The range is empty once deleted, its length is taken before */
+static void
+on_text_delete_range_before (GtkTextBuffer   *buffer,
+                             GtkTextIter     *start,
+                             GtkTextIter     *end,
+                             ClippyTextWatch *watch)
+{
+  watch->removing = gtk_text_iter_get_offset (end) - gtk_text_iter_get_offset (start);
+}
+
+static void
+on_text_delete_range (GtkTextBuffer   *buffer,
+                      GtkTextIter     *start,
+                      GtkTextIter     *end,
+                      ClippyTextWatch *watch)
+{
+  gint offset = gtk_text_iter_get_offset (start);
+  gint removed = watch->removing;
+  TextDelta *last = text_watch_last (watch);
+  gint last_len = last ? last->n_chars : 0;
+
+  watch->removing = 0;
+
+  if (!removed)
+    return;
+
+  if (last && offset >= last->offset && offset + removed <= last->offset + last_len)
+    {
+      /* Deleting text inserted in the same frame */
+      const gchar *from = g_utf8_offset_to_pointer (last->text->str, offset - last->offset);
+      const gchar *to = g_utf8_offset_to_pointer (from, removed);
+
+      g_string_erase (last->text, from - last->text->str, to - from);
+      last->n_chars -= removed;
+    }
+  else if (last && !last_len && offset + removed == last->offset)
+    {
+      /* Backspace */
+      last->offset = offset;
+      last->removed += removed;
+    }
+  else if (last && !last_len && offset == last->offset)
+    /* Delete */
+    last->removed += removed;
+  else
+    {
+      TextDelta delta = { offset, removed, g_string_new (NULL), 0 };
+      g_array_append_val (watch->deltas, delta);
+    }
+
+  text_watch_queue (watch);
+}
+
+static void
+text_watch_free (ClippyTextWatch *watch)
+{
+  g_signal_handlers_disconnect_by_data (watch->buffer, watch);
+
+  if (watch->after_paint_id)
+    g_signal_handler_disconnect (watch->clock, watch->after_paint_id);
+
+  if (watch->idle_id)
+    g_source_remove (watch->idle_id);
+
+  if (watch->timeout_id)
+    g_source_remove (watch->timeout_id);
+
+  g_clear_object (&watch->clock);
+  g_clear_object (&watch->view);
+  g_array_unref (watch->deltas);
+  g_object_unref (watch->buffer);
+  g_free (watch->id);
+  g_free (watch);
+}
+
+typedef struct
+{
+  GtkWidget    *widget;  /* Not referenced, index is rebuilt on any change */
+  GdkRectangle  rect;    /* Visible area in toplevel coordinates */
+  guint         stamp;   /* Last query that reported this entry */
+} HitEntry;
+
+/* Uniform grid over the visible widgets of a toplevel */
+typedef struct
+{
+  Clippy    *clip;
+  GtkWidget *toplevel;
+  gboolean   dirty;
+  GArray    *entries;  /* HitEntry, parents before children in paint order */
+  GArray   **cells;    /* Entry indexes overlapping each cell */
+  gint       cols, rows;
+  guint      stamp;
+} HitIndex;
+
+static void
+hit_index_clear (HitIndex *index)
+{
+  gint i;
+
+  for (i = 0; i < index->cols * index->rows; i++)
+    g_array_unref (index->cells[i]);
+
+  g_clear_pointer (&index->cells, g_free);
+  g_array_set_size (index->entries, 0);
+  index->cols = index->rows = 0;
+}
+
+/* Clamp @rect to the grid, returns FALSE if it does not overlap it */
+static gboolean
+hit_index_cell_range (HitIndex     *index,
+                      GdkRectangle *rect,
+                      gint         *col0,
+                      gint         *row0,
+                      gint         *col1,
+                      gint         *row1)
+{
+  /* Client rectangles can be anywhere, do not overflow on the far edges */
+  gint64 x1 = (gint64) rect->x + rect->width;
+  gint64 y1 = (gint64) rect->y + rect->height;
+
+  if (rect->width <= 0 || rect->height <= 0 || x1 <= 0 || y1 <= 0)
+    return FALSE;
+
+  *col0 = MAX (rect->x, 0) / HIT_INDEX_CELL_SIZE;
+  *row0 = MAX (rect->y, 0) / HIT_INDEX_CELL_SIZE;
+  *col1 = MIN ((x1 - 1) / HIT_INDEX_CELL_SIZE, index->cols - 1);
+  *row1 = MIN ((y1 - 1) / HIT_INDEX_CELL_SIZE, index->rows - 1);
+
+  return *col0 <= *col1 && *row0 <= *row1;
+}
+
+typedef struct
+{
+  HitIndex     *index;
+  GdkRectangle  clip;  /* Parent visible area */
+} HitBuildData;
+
+static void
+hit_index_add_forall (GtkWidget *widget, gpointer user_data)
+{
+  HitBuildData *data = user_data;
+  HitIndex *index = data->index;
+  HitBuildData child_data = { index, { 0, } };
+  GtkAllocation alloc;
+  HitEntry entry = { widget, { 0, }, 0 };
+  gint col0, row0, col1, row1, col, row;
+
+  if (!gtk_widget_is_drawable (widget) ||
+      !gtk_widget_translate_coordinates (widget, index->toplevel, 0, 0,
+                                         &entry.rect.x, &entry.rect.y))
+    return;
+
+  gtk_widget_get_allocation (widget, &alloc);
+  entry.rect.width = alloc.width;
+  entry.rect.height = alloc.height;
+
+  /* Scrolled out parts can not be hit */
+  if (!gdk_rectangle_intersect (&entry.rect, &data->clip, &entry.rect))
+    return;
+
+  if (hit_index_cell_range (index, &entry.rect, &col0, &row0, &col1, &row1))
+    {
+      for (row = row0; row <= row1; row++)
+        for (col = col0; col <= col1; col++)
+          g_array_append_val (index->cells[row * index->cols + col], index->entries->len);
+
+      g_array_append_val (index->entries, entry);
+    }
+
+  if (GTK_IS_CONTAINER (widget))
+    {
+      child_data.clip = entry.rect;
+      gtk_container_forall (GTK_CONTAINER (widget), hit_index_add_forall, &child_data);
+    }
+}
+
+static void
+hit_index_ensure (HitIndex *index)
+{
+  HitBuildData data = { index, { 0, } };
+  gint i;
+
+  if (!index->dirty)
+    return;
+
+  hit_index_clear (index);
+
+  index->cols = MAX (1, (gtk_widget_get_allocated_width (index->toplevel) +
+                         HIT_INDEX_CELL_SIZE - 1) / HIT_INDEX_CELL_SIZE);
+  index->rows = MAX (1, (gtk_widget_get_allocated_height (index->toplevel) +
+                         HIT_INDEX_CELL_SIZE - 1) / HIT_INDEX_CELL_SIZE);
+  index->cells = g_new (GArray *, index->cols * index->rows);
+
+  for (i = 0; i < index->cols * index->rows; i++)
+    index->cells[i] = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  data.clip.width = index->cols * HIT_INDEX_CELL_SIZE;
+  data.clip.height = index->rows * HIT_INDEX_CELL_SIZE;
+  hit_index_add_forall (index->toplevel, &data);
+
+  index->dirty = FALSE;
+}
+
+static void
+hit_index_free (HitIndex *index)
+{
+  g_signal_handlers_disconnect_by_data (index->toplevel, index);
+  hit_index_clear (index);
+  g_array_unref (index->entries);
+  g_free (index);
+}
+
+typedef struct
+{
+  GObject *object;
+  gulong   handler_id;
+} ClippyTrigger;
+
+static void
+clippy_trigger_free (ClippyTrigger *trigger)
+{
+  g_signal_handler_disconnect (trigger->object, trigger->handler_id);
+  g_object_unref (trigger->object);
+  g_free (trigger);
+}
+
+/*
+ * GLib unbinds and finalizes bindings when the source or target goes away,
+ * so we only keep a weak reference and forget the binding with it.
+ */
+typedef struct
+{
+  Clippy   *clip;
+  guint     id;
+  GBinding *binding; /* NULL once finalized */
+} ClippyBinding;
+
+static void
+on_binding_finalized (gpointer data, GObject *where_the_object_was)
+{
+  ClippyBinding *bind = data;
+
+  bind->binding = NULL;
+  g_hash_table_remove (bind->clip->bindings, GUINT_TO_POINTER (bind->id));
+}
+
+static void
+clippy_binding_free (ClippyBinding *bind)
+{
+  if (bind->binding)
+    g_object_weak_unref (G_OBJECT (bind->binding), on_binding_finalized, bind);
+
+  g_free (bind);
+}
+
+typedef struct
+{
+  gchar    *id;
+  GVariant *actions; /* a(sv) method calls to run when entering the step */
+  GVariant *wait;    /* a{sv} event to wait for */
+  GVariant *next;    /* a{ss} outcome -> next step id */
+} ClippyLessonStep;
+
+struct _ClippyLesson
+{
+  Clippy           *clip;
+  gchar            *name;
+  GPtrArray        *steps;   /* ClippyLessonStep program, the first is the entry */
+  ClippyLessonStep *current; /* Running step or NULL */
+
+  GObject          *object;     /* Object the current step is waiting on */
+  gulong            handler_id;
+  ClippySubscription *sub;      /* Subscription of handler_id */
+  guint             timeout_id;
+  guint             advance_id; /* Idle moving to the next step */
+  const gchar      *outcome;    /* Outcome of the current step */
+};
+
+static void
+lesson_step_free (ClippyLessonStep *step)
+{
+  g_free (step->id);
+  g_variant_unref (step->actions);
+  g_variant_unref (step->wait);
+  g_variant_unref (step->next);
+  g_free (step);
+}
+
+static void
+clippy_lesson_cancel_wait (ClippyLesson *lesson)
+{
+  if (lesson->object)
+    {
+      /* Handoffs keep the subscription alive, but not the lesson */
+      lesson->sub->lesson = NULL;
+      lesson->sub->detached = TRUE;
+      lesson->sub = NULL;
+
+      g_signal_handler_disconnect (lesson->object, lesson->handler_id);
+      g_clear_object (&lesson->object);
+      lesson->handler_id = 0;
+    }
+
+  if (lesson->timeout_id)
+    {
+      g_source_remove (lesson->timeout_id);
+      lesson->timeout_id = 0;
+    }
+}
+
+static void
+clippy_lesson_free (ClippyLesson *lesson)
+{
+  clippy_lesson_cancel_wait (lesson);
+
+  if (lesson->advance_id)
+    g_source_remove (lesson->advance_id);
+
+  g_ptr_array_unref (lesson->steps);
+  g_free (lesson->name);
+  g_free (lesson);
+}
+
+typedef struct
+{
+  Clippy                *clip;
+  GDBusMethodInvocation *invocation; /* Deferred WaitFor reply */
+  GObject               *object;
+  GParamSpec            *pspec;
+  ClippyPredicate       *predicate;
+  gulong                 handler_id;
+  guint                  timeout_id;
+  guint                  watch_id;   /* Caller bus name watch */
+} ClippyWait;
+
+static void
+clippy_wait_free (ClippyWait *wait)
+{
+  if (wait->invocation)
+    g_dbus_method_invocation_return_error (wait->invocation,
+                                           CLIPPY_ERROR, CLIPPY_UNKNOWN_ERROR,
+                                           "WaitFor %s cancelled",
+                                           wait->pspec->name);
+  if (wait->handler_id)
+    g_signal_handler_disconnect (wait->object, wait->handler_id);
+
+  if (wait->timeout_id)
+    g_source_remove (wait->timeout_id);
+
+  if (wait->watch_id)
+    g_bus_unwatch_name (wait->watch_id);
+
+  g_object_unref (wait->object);
+  clippy_predicate_free (wait->predicate);
+  g_free (wait);
+}
+
+static Clippy *
+clippy_new (GDBusConnection *connection)
+{
+  Clippy *clip = g_new0 (Clippy, 1);
+
+  clip->connection = g_object_ref (connection);
+
+  clip->events = clippy_events_new (connection, DBUS_OBJECT_PATH, DBUS_IFACE);
+
+  /* Signals that existed before events were sequenced, for compatibility mode */
+  clippy_events_add_legacy (clip->events, "SequencedObjectNotify", "ObjectNotify");
+  clippy_events_add_legacy (clip->events, "SequencedObjectSignal", "ObjectSignal");
+  clippy_events_add_legacy (clip->events, "SequencedMessageDone", "MessageDone");
+
+  clip->provider = gtk_css_provider_new ();
+  gtk_css_provider_load_from_resource (clip->provider, "/com/endlessm/clippy/style.css");
+  gtk_style_context_add_provider_for_screen (gdk_screen_get_default (), 
+                                             GTK_STYLE_PROVIDER (clip->provider),
+                                             GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+
+  /* id -> GtkWidget table */
+  clip->widgets = g_hash_table_new_full (g_str_hash,
+                                         g_str_equal,
+                                         g_free,
+                                         g_object_unref);
+
+  /* Message id -> GtkPopover table */
+  clip->messages = g_hash_table_new_full (g_str_hash,
+                                          g_str_equal,
+                                          g_free,
+                                          g_object_unref);
+
+  clip->subscription = clippy_subscription_new (clip);
+
+  clip->signal_closure = g_cclosure_new (signal_closure_callback, NULL, NULL);
+  g_closure_set_marshal (clip->signal_closure, signal_closure_marshall);
+  g_closure_set_meta_marshal (clip->signal_closure, clip->subscription, signal_closure_marshall);
+  g_closure_ref (clip->signal_closure);
+  g_closure_sink (clip->signal_closure);
+
+  clip->thread = g_thread_self ();
+  notify_signal_id = g_signal_lookup ("notify", G_TYPE_OBJECT);
+  
+  /* type:signal:detail -> ClippyTypeHook table */
+  clip->type_hooks = g_hash_table_new_full (g_str_hash,
+                                            g_str_equal,
+                                            g_free,
+                                            (GDestroyNotify) type_hook_free);
+
+  /* Root id -> ClippyTap table, the tap owns the key */
+  clip->taps = g_hash_table_new_full (g_str_hash,
+                                      g_str_equal,
+                                      NULL,
+                                      (GDestroyNotify) clippy_tap_free);
+
+  /* Object id -> ClippyGeometryWatch table, the watch owns the key */
+  clip->geometry_watches = g_hash_table_new_full (g_str_hash,
+                                                  g_str_equal,
+                                                  NULL,
+                                                  (GDestroyNotify) geometry_watch_free);
+
+  /* Model id -> ClippyRowsWatch table */
+  clip->rows_watches = g_hash_table_new_full (g_str_hash,
+                                              g_str_equal,
+                                              NULL,
+                                              (GDestroyNotify) rows_watch_free);
+
+  /* Object id -> ClippyTextWatch table */
+  clip->text_watches = g_hash_table_new_full (g_str_hash,
+                                              g_str_equal,
+                                              NULL,
+                                              (GDestroyNotify) text_watch_free);
+
+  /* Toplevel -> HitIndex table */
+  clip->hit_indexes = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) hit_index_free);
+
+  /* SubscribeTree id -> ClippyTreeSub table */
+  clip->tree_subs = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) tree_sub_free);
+
+  /* Binding id -> ClippyBinding table */
+  clip->bindings = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) clippy_binding_free);
+
+  /* Trigger id -> ClippyTrigger table */
+  clip->triggers = g_hash_table_new_full (NULL, NULL, NULL,
+                                          (GDestroyNotify) clippy_trigger_free);
+
+  /* Lesson name -> ClippyLesson table, the lesson owns the key */
+  clip->lessons = g_hash_table_new_full (g_str_hash,
+                                         g_str_equal,
+                                         NULL,
+                                         (GDestroyNotify) clippy_lesson_free);
+
+  /* Pending WaitFor set */
+  clip->waits = g_hash_table_new_full (NULL, NULL,
+                                       (GDestroyNotify) clippy_wait_free,
+                                       NULL);
+
+  clip->fd_threshold = DEFAULT_FD_THRESHOLD;
+
+  clip->manager = g_dbus_object_manager_server_new (DBUS_OBJECT_PATH);
+  g_dbus_object_manager_server_set_connection (clip->manager, connection);
+
+  return clip;
+}
+
+static void
+clippy_free (Clippy *clip)
+{
+  ClippyHandoff *handoff, *next;
+
+  gtk_style_context_remove_provider_for_screen (gdk_screen_get_default (),
+                                                GTK_STYLE_PROVIDER (clip->provider));
+  g_clear_object (&clip->connection);
+  g_clear_pointer (&clip->events, clippy_events_free);
+  g_clear_object (&clip->provider);
+  g_clear_object (&clip->manager);
+  g_clear_pointer (&clip->widgets, g_hash_table_unref);
+  g_clear_pointer (&clip->messages, g_hash_table_unref);
+  g_clear_pointer (&clip->type_hooks, g_hash_table_unref);
+  g_clear_pointer (&clip->taps, g_hash_table_unref);
+  clippy_event_handler_update (clip);
+  g_clear_pointer (&clip->geometry_watches, g_hash_table_unref);
+  clippy_geometry_hooks_update (clip);
+  g_clear_pointer (&clip->rows_watches, g_hash_table_unref);
+  g_clear_pointer (&clip->text_watches, g_hash_table_unref);
+  g_clear_pointer (&clip->tree_subs, g_hash_table_unref);
+  clippy_tree_hooks_update (clip);
+  g_clear_pointer (&clip->hit_indexes, g_hash_table_unref);
+  clippy_hit_hooks_update (clip);
+  g_clear_pointer (&clip->bindings, g_hash_table_unref);
+  g_clear_pointer (&clip->triggers, g_hash_table_unref);
+  g_clear_pointer (&clip->lessons, g_hash_table_unref);
+  g_clear_pointer (&clip->waits, g_hash_table_unref);
+  g_clear_pointer (&clip->signal_closure, g_closure_unref);
+
+  for (handoff = clippy_handoff_steal (clip); handoff; handoff = next)
+    {
+      next = handoff->next;
+      clippy_handoff_free (handoff);
+    }
+
+  g_clear_pointer (&clip->subscription, clippy_subscription_unref);
+  g_clear_pointer (&clip->css, g_free);
+}
+
+static void
+clippy_timeout_add (GObject     *object,
+                    guint        timeout,
+                    GSourceFunc  function)
+{
+  gpointer old_id;
+  guint id;
+
+  if (!timeout)
+    return;
+
+  /* Clear old timeout */
+  if ((old_id = g_object_get_data (object, CLIPPY_TIMEOUT_KEY)))
+    g_source_remove (GPOINTER_TO_UINT (old_id));
+
+  /* Add new timeout */
+  id = g_timeout_add (timeout, function, object);
+
+  /* Save new timeout */
+  g_object_set_data (object, CLIPPY_TIMEOUT_KEY, GUINT_TO_POINTER (id));
+}
+
+static void
+clippy_timeout_remove (GObject *object, gboolean clear_source)
+{
+  gpointer timeout;
+
+  if (clear_source && (timeout = g_object_get_data (object, CLIPPY_TIMEOUT_KEY)))
+    g_source_remove (GPOINTER_TO_UINT (timeout));
+
+  g_object_set_data (object, CLIPPY_TIMEOUT_KEY, NULL);
+}
+
+static gboolean
+clippy_highlight_clear (gpointer data)
+{
+  clippy_timeout_remove (data, FALSE);
+  gtk_style_context_remove_class (gtk_widget_get_style_context (data),
+                                  HIGHLIGHT_CLASS);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+clippy_highlight (Clippy       *clip,
+                  const gchar  *object,
+                  guint         timeout,
+                  GError      **error)
+{
+  GObject *gobject;
+
+  /* Find widget */
+  if (!app_get_object_info (object, NULL, NULL,
+                            &gobject, NULL, NULL, error))
+    return;
+
+  clippy_return_if_fail (GTK_IS_WIDGET (gobject),
+                         error, CLIPPY_NOT_A_WIDGET,
+                         "Object '%s' of type %s is not a GtkWidget",
+                         object,
+                         G_OBJECT_TYPE_NAME (gobject));
+
+  /* Insert widget in table */
+  g_hash_table_insert (clip->widgets, g_strdup (object), g_object_ref (gobject));
+
+  g_debug ("%s %s %p", __func__, object, gobject);
+
+  /* Highlight */
+  gtk_style_context_add_class (gtk_widget_get_style_context (GTK_WIDGET (gobject)),
+                               HIGHLIGHT_CLASS);
+
+  clippy_timeout_add (gobject, timeout, clippy_highlight_clear);
+}
+
+static void
+clippy_unhighlight (Clippy *clip, const gchar *object, GError **error)
+{
+  GObject *gobject;
+
+  if (!app_get_object_info (object, NULL, NULL,
+                            &gobject, NULL, NULL, error))
+    return;
+
+  clippy_timeout_remove (gobject, TRUE);
+
+  gtk_style_context_remove_class (gtk_widget_get_style_context (GTK_WIDGET (gobject)),
+                                  HIGHLIGHT_CLASS);
+  g_hash_table_remove (clip->widgets, object);
+}
+
+static void
+on_popover_closed (GtkPopover *popover, Clippy *clip)
+{
+  const gchar *id;
+
+  clippy_timeout_remove (G_OBJECT (popover), TRUE);
+
+  if ((id = gtk_widget_get_name (GTK_WIDGET (popover))))
+    {
+      clippy_emit_signal (clip, CLIPPY_EVENT_PRIORITY_HIGH, NULL,
+                          "SequencedMessageDone", "(s)", id);
+      g_hash_table_remove (clip->messages, id);
+    }
+}
+
+static gboolean
+clippy_popover_clear (gpointer data)
+{
+  clippy_timeout_remove (data, FALSE);
+  gtk_popover_popdown (data);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+clippy_message (Clippy       *clip,
+                const gchar  *id,
+                const gchar  *text,
+                const gchar  *image,
+                const gchar  *relative_to,
+                guint         timeout,
+                GError      **error)
+{
+  GtkWidget *box, *popover;
+
+  if ((popover = g_hash_table_lookup (clip->messages, id)))
+    {
+      /* Reuse existing popover */
+      gtk_container_remove (GTK_CONTAINER (popover),
+                            gtk_bin_get_child (GTK_BIN (popover)));
+    }
+  else
+    {
+      GObject *gobject;
+
+      if (!app_get_object_info (relative_to, NULL, NULL,
+                                &gobject, NULL, NULL, error))
+        return;
+
+      clippy_return_if_fail (GTK_IS_WIDGET (gobject),
+                             error, CLIPPY_NOT_A_WIDGET,
+                             "Object '%s' of type %s is not a GtkWidget",
+                             relative_to,
+                             G_OBJECT_TYPE_NAME (gobject));
+
+      /* Create new popover */
+      popover = gtk_popover_new (GTK_WIDGET (gobject));
+      gtk_widget_set_name (GTK_WIDGET (popover), id);
+
+      g_hash_table_insert (clip->messages,
+                           g_strdup (id),
+                           g_object_ref_sink (popover));
+
+      g_signal_connect (popover, "closed",
+                        G_CALLBACK (on_popover_closed),
+                        clip);
+    }
+
+  box = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 8);
+  g_object_set (box, "margin", 8, NULL);
+  gtk_container_add (GTK_CONTAINER (popover), box);
+
+  if (*image != '\0')
+    {
+      GtkWidget *img = gtk_image_new ();
+      gtk_image_set_from_icon_name (GTK_IMAGE (img), image, GTK_ICON_SIZE_DIALOG);
+      gtk_box_pack_start (GTK_BOX (box), img, FALSE, TRUE, 0);
+    }
+
+  if (*text != '\0')
+    {
+      GtkWidget *label = gtk_label_new (text);
+      gtk_label_set_use_markup (GTK_LABEL (label), TRUE);
+      gtk_box_pack_start (GTK_BOX (box), label, TRUE, TRUE, 0);
+    }
+
+  clippy_timeout_add (G_OBJECT(popover), timeout, clippy_popover_clear);
+
+  gtk_widget_show_all (box);
+  gtk_popover_popup (GTK_POPOVER (popover));
+}
+
+static void
+clippy_message_clear (Clippy *clip, const gchar *id, GError **error)
+{
+  GtkWidget *popover;
+
+  clippy_return_if_fail ((popover = g_hash_table_lookup (clip->messages, id)),
+                         error, CLIPPY_WRONG_MSG_ID,
+                         "Message id '%s' not found",
+                         id);
+
+  gtk_popover_popdown (GTK_POPOVER (popover));
+}
+
+static void
+clippy_set (Clippy       *clip,
+            const gchar  *object,
+            const gchar  *property,
+            GVariant     *variant,
+            GError      **error)
+{
+  g_auto(GValue) gvalue = G_VALUE_INIT;
+  GObject *gobject;
+  GParamSpec *pspec;
+  
+  g_debug ("%s %s %s", __func__, object, property);
+  
+  if (!app_get_object_info (object, property, NULL,
+                            &gobject, &pspec, NULL, error))
+    return;
+
+  g_value_init (&gvalue, pspec->value_type);
+  pspec_value_set_variant (pspec, &gvalue, variant);
+
+  g_object_set_property (gobject, property, &gvalue);
+}
+
+static void
+clippy_get (Clippy       *clip,
+            const gchar  *object,
+            const gchar  *property,
+            GVariant    **return_value,
+            GError      **error)
+{
+  g_auto(GValue) gvalue = G_VALUE_INIT;
+  GObject *gobject;
+  GParamSpec *pspec;
+  
+  g_debug ("%s %s %s", __func__, object, property);
+
+  if (!app_get_object_info (object, property, NULL,
+                            &gobject, &pspec, NULL, error))
+    return;
+
+  g_value_init (&gvalue, pspec->value_type);
+  g_object_get_property (gobject, property, &gvalue);
+
+  if (return_value)
+    *return_value = g_variant_new ("(v)", pspec_variant_new_value (pspec, &gvalue));
+}
+
+static gboolean
+tree_model_get_rows (GtkTreeModel     *model,
+                     guint             offset,
+                     guint             count,
+                     GStrv             columns,
+                     GVariantBuilder  *builder,
+                     GError          **error)
+{
+  gint n_columns = gtk_tree_model_get_n_columns (model);
+  g_autofree ValueToVariantFunc *converters = NULL;
+  g_autofree gint *indices = NULL;
+  gint n_indices, i;
+  GtkTreeIter iter;
+  gboolean valid;
+
+  n_indices = *columns ? (gint) g_strv_length (columns) : n_columns;
+  indices = g_new (gint, n_indices);
+  converters = g_new (ValueToVariantFunc, n_indices);
+
+  /* Resolve columns and their converters once for the whole page */
+  for (i = 0; i < n_indices; i++)
+    {
+      if (*columns)
+        {
+          gchar *end = NULL;
+          gint64 column = g_ascii_strtoll (columns[i], &end, 10);
+
+          clippy_return_val_if_fail (*columns[i] && !*end && column >= 0 && column < n_columns,
+                                     FALSE, error, CLIPPY_NO_PROPERTY,
+                                     "Invalid column '%s', model has %d columns",
+                                     columns[i],
+                                     n_columns);
+          indices[i] = column;
+        }
+      else
+        indices[i] = i;
+
+      converters[i] = value_to_variant_lookup (gtk_tree_model_get_column_type (model, indices[i]));
+    }
+
+  valid = offset <= G_MAXINT && gtk_tree_model_iter_nth_child (model, &iter, NULL, offset);
+
+  for (; valid && count; count--, valid = gtk_tree_model_iter_next (model, &iter))
+    {
+      g_variant_builder_open (builder, G_VARIANT_TYPE ("(av)"));
+      g_variant_builder_open (builder, G_VARIANT_TYPE ("av"));
+
+      for (i = 0; i < n_indices; i++)
+        {
+          g_auto(GValue) value = G_VALUE_INIT;
+
+          gtk_tree_model_get_value (model, &iter, indices[i], &value);
+          g_variant_builder_add (builder, "v", converters[i] (&value));
+        }
+
+      g_variant_builder_close (builder);
+      g_variant_builder_close (builder);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+list_model_get_rows (GListModel       *model,
+                     guint             offset,
+                     guint             count,
+                     GStrv             columns,
+                     GVariantBuilder  *builder,
+                     GError          **error)
+{
+  guint n_items = g_list_model_get_n_items (model);
+  guint i, end;
+
+  end = (offset < n_items) ? offset + MIN (count, n_items - offset) : offset;
+
+  for (i = offset; i < end; i++)
+    {
+      g_autoptr(GObject) item = g_list_model_get_item (model, i);
+      gint j;
+
+      g_variant_builder_open (builder, G_VARIANT_TYPE ("(av)"));
+      g_variant_builder_open (builder, G_VARIANT_TYPE ("av"));
+
+      /* Without columns rows are the item id */
+      if (!*columns)
+        g_variant_builder_add (builder, "v", g_variant_new_string (object_get_id (item)));
+
+      for (j = 0; columns[j]; j++)
+        {
+          g_auto(GValue) value = G_VALUE_INIT;
+
+          if (!object_get_property_path (item, columns[j], &value, error))
+            return FALSE;
+
+          g_variant_builder_add (builder, "v", variant_new_value (&value));
+        }
+
+      g_variant_builder_close (builder);
+      g_variant_builder_close (builder);
+    }
+
+  return TRUE;
+}
+
+static void
+clippy_get_rows (Clippy       *clip,
+                 const gchar  *object,
+                 guint         offset,
+                 guint         count,
+                 GStrv         columns,
+                 GVariant    **return_value,
+                 GError      **error)
+{
+  GVariantBuilder builder;
+  GObject *gobject;
+  gboolean retval;
+  guint n_rows;
+
+  g_debug ("%s %s %u %u", __func__, object, offset, count);
+
+  if (!app_get_object_info (object, NULL, NULL, &gobject, NULL, NULL, error))
+    return;
+
+  clippy_return_if_fail (GTK_IS_TREE_MODEL (gobject) || G_IS_LIST_MODEL (gobject),
+                         error, CLIPPY_NO_OBJECT,
+                         "Object '%s' of type %s is not a GtkTreeModel or GListModel",
+                         object,
+                         G_OBJECT_TYPE_NAME (gobject));
+
+  /* 0 means every row from @offset */
+  if (!count)
+    count = G_MAXUINT;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(av)"));
+
+  if (GTK_IS_TREE_MODEL (gobject))
+    {
+      n_rows = gtk_tree_model_iter_n_children (GTK_TREE_MODEL (gobject), NULL);
+      retval = tree_model_get_rows (GTK_TREE_MODEL (gobject), offset, count, columns, &builder, error);
+    }
+  else
+    {
+      n_rows = g_list_model_get_n_items (G_LIST_MODEL (gobject));
+      retval = list_model_get_rows (G_LIST_MODEL (gobject), offset, count, columns, &builder, error);
+    }
+
+  if (!retval)
+    {
+      g_variant_builder_clear (&builder);
+      return;
+    }
+
+  if (return_value)
+    *return_value = g_variant_new ("(ua(av))", n_rows, &builder);
+  else
+    g_variant_builder_clear (&builder);
+}
+
+/* Resolve @object to a text buffer, either directly or from a text view */
+static GtkTextBuffer *
+app_get_text_buffer (const gchar  *object,
+                     GtkWidget   **view,
+                     GError      **error)
+{
+  GObject *gobject;
+
+  if (!app_get_object_info (object, NULL, NULL, &gobject, NULL, NULL, error))
+    return NULL;
+
+  if (view)
+    *view = GTK_IS_TEXT_VIEW (gobject) ? GTK_WIDGET (gobject) : NULL;
+
+  if (GTK_IS_TEXT_VIEW (gobject))
+    return gtk_text_view_get_buffer (GTK_TEXT_VIEW (gobject));
+
+  clippy_return_val_if_fail (GTK_IS_TEXT_BUFFER (gobject),
+                             NULL, error, CLIPPY_NO_OBJECT,
+                             "Object '%s' of type %s is not a GtkTextBuffer or GtkTextView",
+                             object,
+                             G_OBJECT_TYPE_NAME (gobject));
+
+  return GTK_TEXT_BUFFER (gobject);
+}
+
+static void
+clippy_get_text (Clippy       *clip,
+                 const gchar  *object,
+                 gint          offset,
+                 gint          length,
+                 GVariant    **return_value,
+                 GError      **error)
+{
+  g_autofree gchar *text = NULL;
+  GtkTextIter start, end;
+  GtkTextBuffer *buffer;
+  gint n_chars;
+
+  g_debug ("%s %s %d %d", __func__, object, offset, length);
+
+  if (!(buffer = app_get_text_buffer (object, NULL, error)))
+    return;
+
+  n_chars = gtk_text_buffer_get_char_count (buffer);
+
+  clippy_return_if_fail (offset >= 0 && offset <= n_chars,
+                         error, CLIPPY_WRONG_OPTION,
+                         "Offset %d out of range, buffer has %d characters",
+                         offset,
+                         n_chars);
+
+  /* Only the requested range is copied, -1 reads up to the end */
+  gtk_text_buffer_get_iter_at_offset (buffer, &start, offset);
+
+  if (length < 0 || length > n_chars - offset)
+    gtk_text_buffer_get_end_iter (buffer, &end);
+  else
+    gtk_text_buffer_get_iter_at_offset (buffer, &end, offset + length);
+
+  text = gtk_text_buffer_get_text (buffer, &start, &end, TRUE);
+
+  if (return_value)
+    *return_value = g_variant_new ("(us)", n_chars, text);
+}
+
+#ifdef HAVE_MEMFD_CREATE
+
+#define MEMFD_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+/* Write @variant serialized data into a new sealed memfd */
+static gint
+variant_to_memfd (GVariant *variant, GError **error)
+{
+  const gchar *data = g_variant_get_data (variant);
+  gsize size = g_variant_get_size (variant);
+  gint fd, saved_errno;
+
+  if ((fd = memfd_create ("clippy-value", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+    goto fail;
+
+  while (size)
+    {
+      gssize written = write (fd, data, size);
+
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          goto fail;
+        }
+
+      data += written;
+      size -= written;
+    }
+
+  if (fcntl (fd, F_ADD_SEALS, MEMFD_SEALS) < 0)
+    goto fail;
+
+  return fd;
+
+fail:
+  saved_errno = errno;
+
+  if (fd >= 0)
+    close (fd);
+
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+               "Could not write value memfd: %s",
+               g_strerror (saved_errno));
+  return -1;
+}
+
+typedef struct
+{
+  gpointer data;
+  gsize    size;
+} MemfdMapping;
+
+static void
+memfd_mapping_free (gpointer data)
+{
+  MemfdMapping *mapping = data;
+
+  munmap (mapping->data, mapping->size);
+  g_free (mapping);
+}
+
+/*
+ * Map a sealed memfd as @type serialized data, seals guarantee the sender
+ * can not change or truncate the mapping under us.
+ */
+static GVariant *
+variant_new_from_memfd (const GVariantType *type, gint fd, GError **error)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  MemfdMapping *mapping;
+  struct stat st;
+  gpointer data;
+  gint seals;
+
+  seals = fcntl (fd, F_GET_SEALS);
+  clippy_return_val_if_fail (seals >= 0 && (seals & F_SEAL_SHRINK) && (seals & F_SEAL_WRITE),
+                             NULL, error, CLIPPY_WRONG_OPTION,
+                             "File descriptor %d is not a sealed memfd",
+                             fd);
+
+  if (fstat (fd, &st) < 0)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Could not stat value memfd: %s",
+                   g_strerror (saved_errno));
+      return NULL;
+    }
+
+  if (st.st_size == 0)
+    bytes = g_bytes_new (NULL, 0);
+  else
+    {
+      if ((data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        {
+          gint saved_errno = errno;
+
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                       "Could not map value memfd: %s",
+                       g_strerror (saved_errno));
+          return NULL;
+        }
+
+      mapping = g_new (MemfdMapping, 1);
+      mapping->data = data;
+      mapping->size = st.st_size;
+      bytes = g_bytes_new_with_free_func (data, st.st_size, memfd_mapping_free, mapping);
+    }
+
+  /* Not trusted, GVariant validates data from other processes on access */
+  return g_variant_new_from_bytes (type, bytes, FALSE);
+}
+
+#endif /* HAVE_MEMFD_CREATE */
+
+/*
+ * Reply to @invocation with @property value, passing it out of band in a
+ * memfd if its serialized size is over FdThreshold.
+ * Returns TRUE if it took care of @invocation.
+ */
+static gboolean
+clippy_get_fd (Clippy                 *clip,
+               GDBusMethodInvocation  *invocation,
+               const gchar            *object,
+               const gchar            *property,
+               GError                **error)
+{
+  g_auto(GValue) gvalue = G_VALUE_INIT;
+  g_autoptr(GVariant) value = NULL;
+  GObject *gobject;
+  GParamSpec *pspec;
+
+  g_debug ("%s %s %s", __func__, object, property);
+
+  if (!app_get_object_info (object, property, NULL,
+                            &gobject, &pspec, NULL, error))
+    return FALSE;
+
+  g_value_init (&gvalue, pspec->value_type);
+  g_object_get_property (gobject, property, &gvalue);
+  value = g_variant_ref_sink (pspec_variant_new_value (pspec, &gvalue));
+
+#ifdef HAVE_MEMFD_CREATE
+  if (clip->fd_threshold && g_variant_get_size (value) >= clip->fd_threshold)
+    {
+      g_autoptr(GUnixFDList) fd_list = NULL;
+      gint fd;
+
+      if ((fd = variant_to_memfd (value, error)) < 0)
+        return FALSE;
+
+      /* The list takes ownership of fd */
+      fd_list = g_unix_fd_list_new_from_array (&fd, 1);
+
+      g_dbus_method_invocation_return_value_with_unix_fd_list (invocation,
+                                                               g_variant_new ("(bv)",
+                                                                              TRUE,
+                                                                              g_variant_new ("(sh)",
+                                                                                             g_variant_get_type_string (value),
+                                                                                             0)),
+                                                               fd_list);
+      return TRUE;
+    }
+#endif
+
+  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(bv)", FALSE, value));
+  return TRUE;
+}
+
+static void
+clippy_set_fd (Clippy       *clip,
+               const gchar  *object,
+               const gchar  *property,
+               const gchar  *type,
+               gint32        handle,
+               GUnixFDList  *fd_list,
+               GError      **error)
+{
+#ifdef HAVE_MEMFD_CREATE
+  g_autoptr(GVariant) variant = NULL;
+  gint fd;
+
+  g_debug ("%s %s %s %s", __func__, object, property, type);
+
+  clippy_return_if_fail (g_variant_type_string_is_valid (type),
+                         error, CLIPPY_WRONG_OPTION,
+                         "Invalid value type '%s'",
+                         type);
+
+  clippy_return_if_fail (fd_list && handle >= 0 && handle < g_unix_fd_list_get_length (fd_list),
+                         error, CLIPPY_WRONG_OPTION,
+                         "Invalid file descriptor handle %d",
+                         handle);
+
+  if ((fd = g_unix_fd_list_get (fd_list, handle, error)) < 0)
+    return;
+
+  /* The mapping outlives the descriptor */
+  variant = variant_new_from_memfd (G_VARIANT_TYPE (type), fd, error);
+  close (fd);
+
+  if (variant)
+    clippy_set (clip, object, property, g_variant_ref_sink (variant), error);
+#else
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "SetFd is not supported on this system");
+#endif
+}
+
+/*
+ * Connect to @signal on @object with the default closure, or with a closure
+ * for @sub if not NULL. Takes ownership of @sub.
+ */
+static gulong
+clippy_connect (Clippy              *clip,
+                const gchar         *object,
+                const gchar         *signal,
+                const gchar         *detail,
+                ClippySubscription  *sub,
+                GObject            **connected,
+                GError             **error)
+{
+  g_autoptr(ClippySubscription) owned = sub;
+  GObject *gobject;
+  GClosure *closure;
+  gboolean notify;
+  GQuark quark;
+  guint id;
+
+  g_debug ("%s %s %s %s", __func__, object, signal, detail ? detail : "null");
+
+  if (!app_get_object_info (object, NULL, signal,
+                            &gobject, NULL, &id, error))
+    return 0;
+
+  notify = g_strcmp0 (signal, "notify") == 0;
+  quark = g_quark_from_string (detail);
+  
+  if (notify)
+    clippy_return_val_if_fail (quark,
+                               0, error, CLIPPY_NO_DETAIL,
+                               "Notify signal for object '%s' requires detail (property)",
+                               object);
+  
+  if (owned)
+    {
+      clippy_return_val_if_fail (!owned->predicate || notify,
+                                 0, error, CLIPPY_WRONG_OPTION,
+                                 "Predicates are only supported on notify, not on '%s'",
+                                 signal);
+
+      /* An empty 'params' is fine, it only asks for the emission itself */
+      if (owned->params && owned->params != SUBSCRIPTION_ALL_PARAMS)
+        {
+          GSignalQuery query;
+
+          g_signal_query (id, &query);
+
+          /* Index 0 is the instance */
+          clippy_return_val_if_fail (query.n_params < 63 &&
+                                     (owned->params & ((G_GUINT64_CONSTANT (1) << (query.n_params + 1)) - 1)),
+                                     0, error, CLIPPY_WRONG_OPTION,
+                                     "Option 'params' selects no parameter of signal '%s'",
+                                     signal);
+        }
+
+      closure = clippy_subscription_closure_new (g_steal_pointer (&owned));
+    }
+  else
+    closure = clip->signal_closure;
+
+  if (connected)
+    *connected = gobject;
+
+  return g_signal_connect_closure_by_id (gobject, id, quark, closure, FALSE);
+}
+
+static void
+clippy_connect_type (Clippy       *clip,
+                     const gchar  *type_name,
+                     const gchar  *signal,
+                     const gchar  *detail,
+                     GError      **error)
+{
+  g_autofree gchar *key = NULL;
+  ClippyTypeHook *hook;
+  GSignalQuery query;
+  gboolean notify;
+  GQuark quark;
+  GType type;
+  guint id;
+
+  g_debug ("%s %s %s %s", __func__, type_name, signal, detail ? detail : "null");
+
+  type = g_type_from_name (type_name);
+  clippy_return_if_fail (type && (G_TYPE_IS_OBJECT (type) || G_TYPE_IS_INTERFACE (type)),
+                         error, CLIPPY_NO_TYPE,
+                         "Type '%s' not found",
+                         type_name);
+
+  /* Signals are created in class init, make sure it already happened */
+  if (G_TYPE_IS_INTERFACE (type))
+    g_type_default_interface_ref (type);
+  else
+    g_type_class_ref (type);
+
+  clippy_return_if_fail ((id = g_signal_lookup (signal, type)),
+                         error, CLIPPY_NO_SIGNAL,
+                         "Type %s has no signal '%s'",
+                         type_name,
+                         signal);
+
+  g_signal_query (id, &query);
+
+  clippy_return_if_fail (!(query.signal_flags & G_SIGNAL_NO_HOOKS),
+                         error, CLIPPY_WRONG_SIGNAL_TYPE,
+                         "Signal '%s' of type %s does not support emission hooks",
+                         signal,
+                         type_name);
+
+  quark = (query.signal_flags & G_SIGNAL_DETAILED) ? g_quark_from_string (detail) : 0;
+
+  notify = g_strcmp0 (signal, "notify") == 0;
+
+  if (notify)
+    clippy_return_if_fail (quark,
+                           error, CLIPPY_NO_DETAIL,
+                           "Notify signal for type %s requires detail (property)",
+                           type_name);
+
+  key = g_strdup_printf ("%s:%s:%s", type_name, signal, quark ? detail : "");
+
+  /* Already connected */
+  if (g_hash_table_contains (clip->type_hooks, key))
+    return;
+
+  hook = g_new0 (ClippyTypeHook, 1);
+  hook->sub = clippy_subscription_new (clip);
+  hook->type = type;
+  hook->signal_id = id;
+  hook->hook_id = g_signal_add_emission_hook (id, quark, type_hook_emission, hook,
+                                              (GDestroyNotify) type_hook_destroy);
+
+  g_hash_table_insert (clip->type_hooks, g_steal_pointer (&key), hook);
+}
+
+static void
+clippy_disconnect_type (Clippy       *clip,
+                        const gchar  *type_name,
+                        const gchar  *signal,
+                        const gchar  *detail,
+                        GError      **error)
+{
+  g_autofree gchar *key = NULL;
+  GSignalQuery query;
+  GType type;
+  guint id;
+
+  g_debug ("%s %s %s %s", __func__, type_name, signal, detail ? detail : "null");
+
+  /* Build the same key as ConnectType, which ignores details of undetailed signals */
+  type = g_type_from_name (type_name);
+  id = type ? g_signal_lookup (signal, type) : 0;
+
+  clippy_return_if_fail (id,
+                         error, CLIPPY_NO_SIGNAL,
+                         "Type %s has no signal '%s'",
+                         type_name,
+                         signal);
+
+  g_signal_query (id, &query);
+
+  key = g_strdup_printf ("%s:%s:%s", type_name, signal,
+                         (query.signal_flags & G_SIGNAL_DETAILED) && detail ? detail : "");
+
+  /* Removing the hook is done by type_hook_free() */
+  clippy_return_if_fail (g_hash_table_remove (clip->type_hooks, key),
+                         error, CLIPPY_NO_SIGNAL,
+                         "Type %s signal '%s' is not connected",
+                         type_name,
+                         signal);
+}
+
+/*
+ * Emit an action signal, if @return_value is not NULL it is set to whether
+ * the signal returns a value, the value itself and the value of
+ * @properties after emission.
+ */
+static void
+clippy_emit (Clippy       *clip,
+             const gchar  *signal,
+             const gchar  *detail,
+             GVariant     *params,
+             GStrv         properties,
+             GVariant    **return_value,
+             GError      **error)
+{
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GObject) gobject = NULL;
+  g_autoptr(GError) emit_error = NULL;
+  GVariant *result = NULL, *snapshot;
+  const gchar *object;
+
+  if (!params ||
+      !g_variant_is_of_type (params, G_VARIANT_TYPE_TUPLE) ||
+      !(variant = g_variant_get_child_value (params, 0)) ||
+      !(object = g_variant_get_string (variant, NULL)) ||
+      !app_get_object_info (object, NULL, NULL, &gobject, NULL, NULL, error))
+    return;
+
+  g_debug ("%s %s %s n_children %ld", __func__,
+           object,
+           signal,
+           g_variant_n_children (params));
+
+  /* Keep the object alive to read properties after emission */
+  g_object_ref (gobject);
+
+  object_emit_action_signal (gobject, signal, detail, params,
+                             return_value ? &result : NULL,
+                             &emit_error);
+  if (emit_error)
+    {
+      g_propagate_error (error, g_steal_pointer (&emit_error));
+      return;
+    }
+
+  if (!return_value)
+    return;
+
+  if (properties)
+    snapshot = object_snapshot_properties (gobject, properties);
+  else
+    snapshot = g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0);
+
+  /* DBus does not support maybe types, void signals return an empty array */
+  *return_value = g_variant_new ("(bv@a{sv})",
+                                 result != NULL,
+                                 result ? result : g_variant_new_array (G_VARIANT_TYPE_VARIANT, NULL, 0),
+                                 snapshot);
+}
+
+typedef struct
+{
+  GObject *object;
+  guint    depth;
+  guint    first_child; /* Index of the first child node */
+  guint    n_children;
+} SnapshotNode;
+
+typedef struct
+{
+  GArray     *nodes;     /* SnapshotNode array in breadth first order */
+  GHashTable *interned;  /* String -> index + 1 in strings */
+  GPtrArray  *strings;   /* String table */
+  guint       max_depth; /* 0 for no limit */
+  GType       type;      /* Type filter */
+} Snapshot;
+
+static guint
+snapshot_intern (Snapshot *snap, const gchar *string)
+{
+  guint index = GPOINTER_TO_UINT (g_hash_table_lookup (snap->interned, string));
+
+  if (index)
+    return index - 1;
+
+  g_ptr_array_add (snap->strings, (gpointer) string);
+  g_hash_table_insert (snap->interned, (gpointer) string, GUINT_TO_POINTER (snap->strings->len));
+
+  return snap->strings->len - 1;
+}
+
+static void snapshot_collect (Snapshot *snap, GtkWidget *widget, guint depth);
+
+typedef struct
+{
+  Snapshot *snap;
+  guint     depth;
+} SnapshotCollect;
+
+static void
+snapshot_collect_forall (GtkWidget *widget, gpointer user_data)
+{
+  SnapshotCollect *data = user_data;
+
+  /* Children not matching the filter are skipped but not their descendants */
+  if (g_type_is_a (G_OBJECT_TYPE (widget), data->snap->type))
+    {
+      SnapshotNode node = { G_OBJECT (widget), data->depth, 0, 0 };
+      g_array_append_val (data->snap->nodes, node);
+    }
+  else
+    snapshot_collect (data->snap, widget, data->depth);
+}
+
+/* Append @widget descendants included in the snapshot, one level at a time */
+static void
+snapshot_collect (Snapshot *snap, GtkWidget *widget, guint depth)
+{
+  SnapshotCollect data = { snap, depth + 1 };
+
+  if (!GTK_IS_CONTAINER (widget) || (snap->max_depth && depth >= snap->max_depth))
+    return;
+
+  gtk_container_forall (GTK_CONTAINER (widget), snapshot_collect_forall, &data);
+}
+
+/* Roots not matching the filter are replaced by their first included descendants */
+static void
+snapshot_add_root (Snapshot *snap, GObject *object)
+{
+  if (g_type_is_a (G_OBJECT_TYPE (object), snap->type))
+    {
+      SnapshotNode node = { object, 0, 0, 0 };
+      g_array_append_val (snap->nodes, node);
+    }
+  else if (GTK_IS_WIDGET (object))
+    snapshot_collect (snap, GTK_WIDGET (object), 0);
+}
+
+static GVariant *
+snapshot_node_properties (Snapshot *snap, GObject *object, GStrv properties)
+{
+  GVariantBuilder builder;
+  gint i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(uv)"));
+
+  for (i = 0; properties[i]; i++)
+    {
+      g_auto(GValue) value = G_VALUE_INIT;
+
+      /* Properties the object does not have are just skipped */
+      if (object_get_property_path (object, properties[i], &value, NULL))
+        g_variant_builder_add (&builder, "(uv)",
+                               snapshot_intern (snap, properties[i]),
+                               variant_new_value (&value));
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+static void
+clippy_snapshot (Clippy       *clip,
+                 const gchar  *root,
+                 guint         depth,
+                 GStrv         properties,
+                 const gchar  *type_filter,
+                 GVariant    **return_value,
+                 GError      **error)
+{
+  g_autoptr(GHashTable) interned = NULL;
+  g_autoptr(GPtrArray) strings = NULL;
+  g_autoptr(GArray) nodes = NULL;
+  GVariantBuilder builder;
+  Snapshot snap;
+  guint i, n_roots;
+
+  g_debug ("%s %s %u %s", __func__, root, depth, type_filter);
+
+  nodes = g_array_new (FALSE, FALSE, sizeof (SnapshotNode));
+  interned = g_hash_table_new (g_str_hash, g_str_equal);
+  strings = g_ptr_array_new ();
+
+  snap.nodes = nodes;
+  snap.interned = interned;
+  snap.strings = strings;
+  snap.max_depth = depth;
+  snap.type = *type_filter ? g_type_from_name (type_filter) : G_TYPE_OBJECT;
+
+  clippy_return_if_fail (snap.type,
+                         error, CLIPPY_NO_TYPE,
+                         "Type '%s' not found",
+                         type_filter);
+
+  /* Roots, either the given object or every visible toplevel */
+  if (*root)
+    {
+      GObject *object;
+
+      if (!app_get_object_info (root, NULL, NULL, &object, NULL, NULL, error))
+        return;
+
+      snapshot_add_root (&snap, object);
+    }
+  else
+    {
+      GList *toplevels, *l;
+
+      toplevels = gtk_window_list_toplevels ();
+
+      for (l = toplevels; l; l = g_list_next (l))
+        if (gtk_widget_is_visible (l->data))
+          snapshot_add_root (&snap, l->data);
+
+      g_list_free (toplevels);
+    }
+
+  n_roots = nodes->len;
+
+  /* Breadth first, so every node children are contiguous */
+  for (i = 0; i < nodes->len; i++)
+    {
+      SnapshotNode *node = &g_array_index (nodes, SnapshotNode, i);
+      guint first_child = nodes->len;
+
+      if (GTK_IS_WIDGET (node->object))
+        snapshot_collect (&snap, GTK_WIDGET (node->object), node->depth);
+
+      /* The array might have been reallocated */
+      node = &g_array_index (nodes, SnapshotNode, i);
+      node->first_child = first_child;
+      node->n_children = nodes->len - first_child;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(suuua(uv))"));
+
+  for (i = 0; i < nodes->len; i++)
+    {
+      SnapshotNode *node = &g_array_index (nodes, SnapshotNode, i);
+
+      g_variant_builder_add (&builder, "(suuu@a(uv))",
+                             object_get_id (node->object),
+                             snapshot_intern (&snap, G_OBJECT_TYPE_NAME (node->object)),
+                             node->first_child,
+                             node->n_children,
+                             snapshot_node_properties (&snap, node->object, properties));
+    }
+
+  /* Strings are all static or owned by the caller */
+  g_ptr_array_add (strings, NULL);
+
+  if (return_value)
+    *return_value = g_variant_new ("(^asua(suuua(uv)))",
+                                   (gchar **) strings->pdata,
+                                   n_roots,
+                                   &builder);
+  else
+    g_variant_builder_clear (&builder);
+}
+
+static void
+clippy_export (Clippy       *clip,
+               const gchar  *object,
+               GVariant    **return_value,
+               GError      **error)
+{
+  g_autoptr(GDBusObjectSkeleton) skeleton = NULL;
+  g_autoptr(ClippyDbusWrapper) interface = NULL;
+  g_autofree gchar *object_path = NULL;
+  g_autoptr(GString) node_info = NULL;
+  GDBusInterfaceInfo *info;
+  GObject *gobject;
+
+  g_debug ("%s %s", __func__, object);
+
+  if (!app_get_object_info (object, NULL, NULL, &gobject, NULL, NULL, error))
+    return;
+
+  object_path = g_build_path ("/", DBUS_OBJECT_PATH, "objects", object, NULL);
+
+  /* Replace dots with slashes */
+  str_replace_char (object_path, '.', '/');
+
+  skeleton = g_dbus_object_skeleton_new (object_path);
+  clippy_return_if_fail (skeleton,
+                         error, CLIPPY_NO_OBJECT,
+                         "Could not create dbus skeleton for object '%s'",
+                         object);
+
+  interface = clippy_dbus_wrapper_new (gobject, object_path);
+
+  /* We need to increment  the reference count of the dynamic info struct since
+   * DBus will try to unref it when unexporting it!
+   */
+  info = g_dbus_interface_skeleton_get_info (G_DBUS_INTERFACE_SKELETON (interface));
+  g_dbus_interface_info_ref (info);
+
+  g_dbus_object_skeleton_add_interface (skeleton, G_DBUS_INTERFACE_SKELETON (interface));
+  g_dbus_object_manager_server_export (clip->manager, skeleton);
+
+  clippy_return_if_fail (g_dbus_object_manager_server_is_exported(clip->manager, skeleton),
+                         error, CLIPPY_NO_OBJECT,
+                         "Could not export object '%s' on dbus path '%s'",
+                         object,
+                         g_dbus_object_get_object_path (G_DBUS_OBJECT (skeleton)));
+
+  node_info = g_string_new ("<node xmlns:doc=\"http://www.freedesktop.org/dbus/1.0/doc.dtd\">\n");
+  g_dbus_interface_info_generate_xml (info, 2, node_info);
+  g_string_append (node_info,"</node>");
+
+  if (return_value)
+    *return_value = g_variant_new ("(ss)", object_path, node_info->str);
+}
+
+static void
+clippy_watch_geometry (Clippy       *clip,
+                       const gchar  *object,
+                       GError      **error)
+{
+  ClippyGeometryWatch *watch;
+  GObject *gobject;
+
+  g_debug ("%s %s", __func__, object);
+
+  if (!app_get_object_info (object, NULL, NULL, &gobject, NULL, NULL, error))
+    return;
+
+  clippy_return_if_fail (GTK_IS_WIDGET (gobject),
+                         error, CLIPPY_NOT_A_WIDGET,
+                         "Object '%s' of type %s is not a GtkWidget",
+                         object,
+                         G_OBJECT_TYPE_NAME (gobject));
+
+  watch = g_new0 (ClippyGeometryWatch, 1);
+  watch->clip = clip;
+  watch->id = g_strdup (object);
+  watch->widget = g_object_ref (GTK_WIDGET (gobject));
+  watch->rect.width = -1; /* Make sure initial state is reported */
+
+  g_signal_connect_swapped (gobject, "map", G_CALLBACK (geometry_watch_queue), watch);
+  g_signal_connect_swapped (gobject, "unmap", G_CALLBACK (geometry_watch_queue), watch);
+  g_signal_connect_swapped (gobject, "notify::visible", G_CALLBACK (geometry_watch_queue), watch);
+  g_signal_connect_swapped (gobject, "size-allocate", G_CALLBACK (geometry_watch_queue), watch);
+
+  g_hash_table_replace (clip->geometry_watches, watch->id, watch);
+  clippy_geometry_hooks_update (clip);
+
+  /* Report initial state */
+  geometry_watch_queue (watch);
+}
+
+static void
+clippy_unwatch_geometry (Clippy *clip, const gchar *object, GError **error)
+{
+  g_debug ("%s %s", __func__, object);
+
+  clippy_return_if_fail (g_hash_table_remove (clip->geometry_watches, object),
+                         error, CLIPPY_NO_OBJECT,
+                         "No geometry watch on object '%s'",
+                         object);
+
+  clippy_geometry_hooks_update (clip);
+}
+
+/* Scrolling moves widgets without allocating them */
+static gboolean
+geometry_adjustment_emission (GSignalInvocationHint *hint,
+                              guint                  n_param_values,
+                              const GValue          *param_values,
+                              gpointer               data)
+{
+  Clippy *clip = data;
+  ClippyGeometryWatch *watch;
+  GHashTableIter iter;
+
+  if (g_thread_self () != clip->thread)
+    return TRUE;
+
+  g_hash_table_iter_init (&iter, clip->geometry_watches);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &watch))
+    geometry_watch_queue (watch);
+
+  return TRUE;
+}
+
+/* The emission hook is only installed while there are geometry watches */
+static void
+clippy_geometry_hooks_update (Clippy *clip)
+{
+  gboolean needed = clip->geometry_watches && g_hash_table_size (clip->geometry_watches);
+  g_autoptr(GTypeClass) adjustment_class = g_type_class_ref (GTK_TYPE_ADJUSTMENT);
+  guint value_changed_id = g_signal_lookup ("value-changed", GTK_TYPE_ADJUSTMENT);
+
+  if (needed && !clip->geometry_adjustment_hook)
+    clip->geometry_adjustment_hook = g_signal_add_emission_hook (value_changed_id, 0,
+                                                                 geometry_adjustment_emission,
+                                                                 clip, NULL);
+  else if (!needed && clip->geometry_adjustment_hook)
+    {
+      g_signal_remove_emission_hook (value_changed_id, clip->geometry_adjustment_hook);
+      clip->geometry_adjustment_hook = 0;
+    }
+}
+
+typedef struct
+{
+  GDBusMethodInvocation *invocation;
+  GStrv                  objects;
+  GPtrArray             *widgets;
+  GPtrArray             *clocks;     /* Frame clocks we are waiting to paint */
+  guint                  timeout_id;
+} GeometryQuery;
+
+/* Sample every widget at once and reply */
+static void
+geometry_query_reply (GeometryQuery *query)
+{
+  GVariantBuilder builder;
+  guint i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sbb(iiii))"));
+
+  for (i = 0; i < query->widgets->len; i++)
+    {
+      GtkWidget *widget = g_ptr_array_index (query->widgets, i);
+      GtkWidget *toplevel = gtk_widget_get_toplevel (widget);
+      GdkWindow *window = gtk_widget_get_window (toplevel);
+      GtkAllocation alloc;
+      gint x = 0, y = 0, origin_x = 0, origin_y = 0;
+
+      gtk_widget_get_allocation (widget, &alloc);
+
+      if (!gtk_widget_translate_coordinates (widget, toplevel, 0, 0, &x, &y))
+        x = y = 0;
+
+      /* Toplevel coordinates to screen coordinates */
+      if (window && gtk_widget_get_realized (toplevel))
+        gdk_window_get_origin (window, &origin_x, &origin_y);
+
+      g_variant_builder_add (&builder, "(sbb(iiii))",
+                             query->objects[i],
+                             gtk_widget_get_mapped (widget),
+                             gtk_widget_get_visible (widget),
+                             origin_x + x, origin_y + y,
+                             alloc.width, alloc.height);
+    }
+
+  g_dbus_method_invocation_return_value (query->invocation,
+                                         g_variant_new ("(a(sbb(iiii)))", &builder));
+
+  for (i = 0; i < query->clocks->len; i++)
+    g_signal_handlers_disconnect_by_data (g_ptr_array_index (query->clocks, i), query);
+
+  if (query->timeout_id)
+    g_source_remove (query->timeout_id);
+
+  g_ptr_array_unref (query->clocks);
+  g_ptr_array_unref (query->widgets);
+  g_strfreev (query->objects);
+  g_free (query);
+}
+
+static void
+on_geometry_query_after_paint (GdkFrameClock *clock, GeometryQuery *query)
+{
+  g_signal_handlers_disconnect_by_data (clock, query);
+  g_ptr_array_remove_fast (query->clocks, clock);
+
+  if (!query->clocks->len)
+    geometry_query_reply (query);
+}
+
+/* Do not wait forever on a toplevel that got unmapped */
+static gboolean
+on_geometry_query_timeout (gpointer data)
+{
+  GeometryQuery *query = data;
+
+  query->timeout_id = 0;
+  geometry_query_reply (query);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Reply with the screen geometry of every object in @objects sampled
+ * together after the next paint of their toplevels, so that no value is
+ * read in the middle of a layout.
+ * Returns TRUE if it took care of @invocation.
+ */
+static gboolean
+clippy_get_geometry (Clippy                 *clip,
+                     GDBusMethodInvocation  *invocation,
+                     GStrv                   objects,
+                     GError                **error)
+{
+  g_autoptr(GPtrArray) widgets = g_ptr_array_new_with_free_func (g_object_unref);
+  GeometryQuery *query;
+  guint i;
+
+  g_debug ("%s", __func__);
+
+  for (i = 0; objects[i]; i++)
+    {
+      GObject *gobject;
+
+      if (!app_get_object_info (objects[i], NULL, NULL, &gobject, NULL, NULL, error))
+        return FALSE;
+
+      clippy_return_val_if_fail (GTK_IS_WIDGET (gobject),
+                                 FALSE, error, CLIPPY_NOT_A_WIDGET,
+                                 "Object '%s' of type %s is not a GtkWidget",
+                                 objects[i],
+                                 G_OBJECT_TYPE_NAME (gobject));
+
+      g_ptr_array_add (widgets, g_object_ref (gobject));
+    }
+
+  query = g_new0 (GeometryQuery, 1);
+  query->invocation = invocation;
+  query->objects = g_strdupv (objects);
+  query->widgets = g_steal_pointer (&widgets);
+  query->clocks = g_ptr_array_new_with_free_func (g_object_unref);
+
+  /* Wait for one paint of every distinct mapped toplevel */
+  for (i = 0; i < query->widgets->len; i++)
+    {
+      GtkWidget *toplevel = gtk_widget_get_toplevel (g_ptr_array_index (query->widgets, i));
+      GdkFrameClock *clock;
+      guint j;
+
+      if (!gtk_widget_get_mapped (toplevel) ||
+          !(clock = gtk_widget_get_frame_clock (toplevel)))
+        continue;
+
+      for (j = 0; j < query->clocks->len; j++)
+        if (g_ptr_array_index (query->clocks, j) == clock)
+          break;
+
+      if (j < query->clocks->len)
+        continue;
+
+      g_ptr_array_add (query->clocks, g_object_ref (clock));
+      g_signal_connect (clock, "after-paint", G_CALLBACK (on_geometry_query_after_paint), query);
+      gdk_frame_clock_request_phase (clock, GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
+    }
+
+  if (query->clocks->len)
+    query->timeout_id = g_timeout_add (GEOMETRY_QUERY_TIMEOUT, on_geometry_query_timeout, query);
+  else
+    geometry_query_reply (query);
+
+  return TRUE;
+}
+
+static void
+hit_invalidate_toplevel (Clippy *clip, GtkWidget *widget)
+{
+  HitIndex *index;
+
+  if ((index = g_hash_table_lookup (clip->hit_indexes, gtk_widget_get_toplevel (widget))))
+    index->dirty = TRUE;
+}
+
+/* Widgets leaving a toplevel are still indexed there, and might be destroyed */
+static gboolean
+hit_parent_set_emission (GSignalInvocationHint *hint,
+                         guint                  n_param_values,
+                         const GValue          *param_values,
+                         gpointer               data)
+{
+  Clippy *clip = data;
+  GtkWidget *old_parent = g_value_get_object (&param_values[1]);
+
+  if (g_thread_self () != clip->thread)
+    return TRUE;
+
+  hit_invalidate_toplevel (clip, g_value_get_object (param_values));
+
+  if (old_parent)
+    hit_invalidate_toplevel (clip, old_parent);
+
+  return TRUE;
+}
+
+static gboolean
+hit_invalidate_emission (GSignalInvocationHint *hint,
+                         guint                  n_param_values,
+                         const GValue          *param_values,
+                         gpointer               data)
+{
+  Clippy *clip = data;
+  GObject *object = g_value_get_object (param_values);
+
+  if (g_thread_self () != clip->thread)
+    return TRUE;
+
+  if (GTK_IS_WIDGET (object))
+    hit_invalidate_toplevel (clip, GTK_WIDGET (object));
+  else
+    {
+      GHashTableIter iter;
+      HitIndex *index;
+
+      /* Scrolling moves children without allocating them */
+      g_hash_table_iter_init (&iter, clip->hit_indexes);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &index))
+        index->dirty = TRUE;
+    }
+
+  return TRUE;
+}
+
+/* Emission hooks are only installed while there are hit indexes */
+static void
+clippy_hit_hooks_update (Clippy *clip)
+{
+  gboolean needed = clip->hit_indexes && g_hash_table_size (clip->hit_indexes);
+  g_autoptr(GTypeClass) adjustment_class = g_type_class_ref (GTK_TYPE_ADJUSTMENT);
+  guint allocate_id = g_signal_lookup ("size-allocate", GTK_TYPE_WIDGET);
+  guint parent_set_id = g_signal_lookup ("parent-set", GTK_TYPE_WIDGET);
+  guint unmap_id = g_signal_lookup ("unmap", GTK_TYPE_WIDGET);
+  guint value_changed_id = g_signal_lookup ("value-changed", GTK_TYPE_ADJUSTMENT);
+
+  if (needed && !clip->hit_allocate_hook)
+    {
+      clip->hit_allocate_hook = g_signal_add_emission_hook (allocate_id, 0,
+                                                            hit_invalidate_emission,
+                                                            clip, NULL);
+      clip->hit_parent_set_hook = g_signal_add_emission_hook (parent_set_id, 0,
+                                                              hit_parent_set_emission,
+                                                              clip, NULL);
+      /* Hiding a mapped widget unmaps it, without allocating anything */
+      clip->hit_unmap_hook = g_signal_add_emission_hook (unmap_id, 0,
+                                                         hit_invalidate_emission,
+                                                         clip, NULL);
+      clip->hit_adjustment_hook = g_signal_add_emission_hook (value_changed_id, 0,
+                                                              hit_invalidate_emission,
+                                                              clip, NULL);
+    }
+  else if (!needed && clip->hit_allocate_hook)
+    {
+      g_signal_remove_emission_hook (allocate_id, clip->hit_allocate_hook);
+      g_signal_remove_emission_hook (parent_set_id, clip->hit_parent_set_hook);
+      g_signal_remove_emission_hook (unmap_id, clip->hit_unmap_hook);
+      g_signal_remove_emission_hook (value_changed_id, clip->hit_adjustment_hook);
+      clip->hit_allocate_hook = clip->hit_parent_set_hook = 0;
+      clip->hit_unmap_hook = clip->hit_adjustment_hook = 0;
+    }
+}
+
+static void
+on_hit_index_toplevel_destroy (GtkWidget *toplevel, HitIndex *index)
+{
+  Clippy *clip = index->clip;
+
+  g_hash_table_remove (clip->hit_indexes, toplevel);
+  clippy_hit_hooks_update (clip);
+}
+
+/* Get the up to date hit test index of @object toplevel */
+static HitIndex *
+clippy_hit_index_get (Clippy *clip, const gchar *object, GError **error)
+{
+  GtkWidget *toplevel;
+  GObject *gobject;
+  HitIndex *index;
+
+  if (!app_get_object_info (object, NULL, NULL, &gobject, NULL, NULL, error))
+    return NULL;
+
+  clippy_return_val_if_fail (GTK_IS_WIDGET (gobject),
+                             NULL, error, CLIPPY_NOT_A_WIDGET,
+                             "Object '%s' of type %s is not a GtkWidget",
+                             object,
+                             G_OBJECT_TYPE_NAME (gobject));
+
+  toplevel = gtk_widget_get_toplevel (GTK_WIDGET (gobject));
+
+  if (!(index = g_hash_table_lookup (clip->hit_indexes, toplevel)))
+    {
+      index = g_new0 (HitIndex, 1);
+      index->clip = clip;
+      index->toplevel = toplevel;
+      index->entries = g_array_new (FALSE, FALSE, sizeof (HitEntry));
+      index->dirty = TRUE;
+
+      g_signal_connect (toplevel, "destroy", G_CALLBACK (on_hit_index_toplevel_destroy), index);
+      g_hash_table_insert (clip->hit_indexes, toplevel, index);
+      clippy_hit_hooks_update (clip);
+    }
+
+  hit_index_ensure (index);
+
+  return index;
+}
+
+static void
+clippy_widget_at (Clippy       *clip,
+                  const gchar  *object,
+                  gint          x,
+                  gint          y,
+                  GVariant    **return_value,
+                  GError      **error)
+{
+  GdkRectangle point = { x, y, 1, 1 };
+  gint col0, row0, col1, row1;
+  HitEntry *hit = NULL;
+  HitIndex *index;
+  GArray *cell;
+  guint i;
+
+  g_debug ("%s %s %d %d", __func__, object, x, y);
+
+  if (!(index = clippy_hit_index_get (clip, object, error)))
+    return;
+
+  if (hit_index_cell_range (index, &point, &col0, &row0, &col1, &row1))
+    {
+      cell = index->cells[row0 * index->cols + col0];
+
+      /* Entries are in paint order, the last one containing the point is on top */
+      for (i = cell->len; i > 0 && !hit; i--)
+        {
+          HitEntry *entry = &g_array_index (index->entries, HitEntry,
+                                            g_array_index (cell, guint, i - 1));
+
+          if (gdk_rectangle_intersect (&entry->rect, &point, NULL))
+            hit = entry;
+        }
+    }
+
+  if (return_value)
+    *return_value = g_variant_new ("(s)", hit ? object_get_id (G_OBJECT (hit->widget)) : "");
+}
+
+static gint
+uint_compare (gconstpointer a, gconstpointer b)
+{
+  guint ua = *(const guint *) a, ub = *(const guint *) b;
+  return (ua > ub) - (ua < ub);
+}
+
+/* Same as gdk_rectangle_intersect() without overflowing on client rectangles */
+static gboolean
+hit_entry_overlaps (HitEntry *entry, GdkRectangle *rect)
+{
+  return entry->rect.x < (gint64) rect->x + rect->width &&
+         rect->x < entry->rect.x + entry->rect.width &&
+         entry->rect.y < (gint64) rect->y + rect->height &&
+         rect->y < entry->rect.y + entry->rect.height;
+}
+
+static void
+clippy_widgets_in_rect (Clippy       *clip,
+                        const gchar  *object,
+                        GdkRectangle *rect,
+                        GVariant    **return_value,
+                        GError      **error)
+{
+  gint col0, row0, col1, row1, col, row;
+  g_autoptr(GArray) hits = NULL;
+  GVariantBuilder builder;
+  HitIndex *index;
+  guint i;
+
+  g_debug ("%s %s", __func__, object);
+
+  clippy_return_if_fail (rect->width >= 0 && rect->height >= 0,
+                         error, CLIPPY_WRONG_OPTION,
+                         "Rectangle size %dx%d is negative",
+                         rect->width,
+                         rect->height);
+
+  if (!(index = clippy_hit_index_get (clip, object, error)))
+    return;
+
+  hits = g_array_new (FALSE, FALSE, sizeof (guint));
+  index->stamp++;
+
+  if (hit_index_cell_range (index, rect, &col0, &row0, &col1, &row1))
+    for (row = row0; row <= row1; row++)
+      for (col = col0; col <= col1; col++)
+        {
+          GArray *cell = index->cells[row * index->cols + col];
+
+          for (i = 0; i < cell->len; i++)
+            {
+              guint n = g_array_index (cell, guint, i);
+              HitEntry *entry = &g_array_index (index->entries, HitEntry, n);
+
+              /* Entries span several cells, report them once */
+              if (entry->stamp == index->stamp ||
+                  !hit_entry_overlaps (entry, rect))
+                continue;
+
+              entry->stamp = index->stamp;
+              g_array_append_val (hits, n);
+            }
+        }
+
+  /* Report in paint order, parents before children */
+  g_array_sort (hits, uint_compare);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_STRING_ARRAY);
+
+  for (i = 0; i < hits->len; i++)
+    {
+      HitEntry *entry = &g_array_index (index->entries, HitEntry, g_array_index (hits, guint, i));
+      g_variant_builder_add (&builder, "s", object_get_id (G_OBJECT (entry->widget)));
+    }
+
+  if (return_value)
+    *return_value = g_variant_new ("(as)", &builder);
+  else
+    g_variant_builder_clear (&builder);
+}
+
+static void
+clippy_watch_rows (Clippy       *clip,
+                   const gchar  *object,
+                   GError      **error)
+{
+  ClippyRowsWatch *watch;
+  GObject *gobject;
+
+  g_debug ("%s %s", __func__, object);
+
+  if (!app_get_object_info (object, NULL, NULL, &gobject, NULL, NULL, error))
+    return;
+
+  clippy_return_if_fail (GTK_IS_TREE_MODEL (gobject) || G_IS_LIST_MODEL (gobject),
+                         error, CLIPPY_NO_OBJECT,
+                         "Object '%s' of type %s is not a GtkTreeModel or GListModel",
+                         object,
+                         G_OBJECT_TYPE_NAME (gobject));
+
+  watch = g_new0 (ClippyRowsWatch, 1);
+  watch->clip = clip;
+  watch->id = g_strdup (object);
+  watch->model = g_object_ref (gobject);
+  watch->changes = g_array_new (FALSE, FALSE, sizeof (RowsChange));
+
+  if (GTK_IS_TREE_MODEL (gobject))
+    {
+      g_signal_connect (gobject, "row-changed", G_CALLBACK (on_rows_row_changed), watch);
+      g_signal_connect (gobject, "row-inserted", G_CALLBACK (on_rows_row_inserted), watch);
+      g_signal_connect (gobject, "row-deleted", G_CALLBACK (on_rows_row_deleted), watch);
+      g_signal_connect (gobject, "rows-reordered", G_CALLBACK (on_rows_rows_reordered), watch);
+    }
+  else
+    g_signal_connect (gobject, "items-changed", G_CALLBACK (on_rows_items_changed), watch);
+
+  g_hash_table_replace (clip->rows_watches, watch->id, watch);
+}
+
+static void
+clippy_unwatch_rows (Clippy *clip, const gchar *object, GError **error)
+{
+  g_debug ("%s %s", __func__, object);
+
+  clippy_return_if_fail (g_hash_table_remove (clip->rows_watches, object),
+                         error, CLIPPY_NO_OBJECT,
+                         "No rows watch on model '%s'",
+                         object);
+}
+
+static void
+clippy_watch_text (Clippy       *clip,
+                   const gchar  *object,
+                   GError      **error)
+{
+  ClippyTextWatch *watch;
+  GtkTextBuffer *buffer;
+  GtkWidget *view;
+
+  g_debug ("%s %s", __func__, object);
+
+  if (!(buffer = app_get_text_buffer (object, &view, error)))
+    return;
+
+  watch = g_new0 (ClippyTextWatch, 1);
+  watch->clip = clip;
+  watch->id = g_strdup (object);
+  watch->buffer = g_object_ref (buffer);
+  watch->view = view ? g_object_ref (view) : NULL;
+  watch->deltas = g_array_new (FALSE, FALSE, sizeof (TextDelta));
+  g_array_set_clear_func (watch->deltas, (GDestroyNotify) text_delta_clear);
+
+  g_signal_connect_after (buffer, "insert-text", G_CALLBACK (on_text_insert_text), watch);
+  g_signal_connect (buffer, "delete-range", G_CALLBACK (on_text_delete_range_before), watch);
+  g_signal_connect_after (buffer, "delete-range", G_CALLBACK (on_text_delete_range), watch);
+
+  g_hash_table_replace (clip->text_watches, watch->id, watch);
+}
+
+static void
+clippy_unwatch_text (Clippy *clip, const gchar *object, GError **error)
+{
+  g_debug ("%s %s", __func__, object);
+
+  clippy_return_if_fail (g_hash_table_remove (clip->text_watches, object),
+                         error, CLIPPY_NO_OBJECT,
+                         "No text watch on object '%s'",
+                         object);
+}
+
+static gboolean
+tree_parent_set_emission (GSignalInvocationHint *hint,
+                          guint                  n_param_values,
+                          const GValue          *param_values,
+                          gpointer               data)
+{
+  Clippy *clip = data;
+  GtkWidget *widget = g_value_get_object (param_values);
+  GtkWidget *old_parent = g_value_get_object (&param_values[1]);
+  GHashTableIter iter;
+  ClippyTreeSub *sub;
+
+  if (g_thread_self () != clip->thread)
+    return TRUE;
+
+  g_hash_table_iter_init (&iter, clip->tree_subs);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &sub))
+    tree_sub_parent_set (sub, widget, old_parent);
+
+  return TRUE;
+}
+
+static gboolean
+tree_notify_emission (GSignalInvocationHint *hint,
+                      guint                  n_param_values,
+                      const GValue          *param_values,
+                      gpointer               data)
+{
+  Clippy *clip = data;
+  GObject *object = g_value_get_object (param_values);
+  GHashTableIter iter;
+  ClippyTreeSub *sub;
+
+  if (!GTK_IS_WIDGET (object) || g_thread_self () != clip->thread)
+    return TRUE;
+
+  g_hash_table_iter_init (&iter, clip->tree_subs);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &sub))
+    tree_sub_notify (sub, GTK_WIDGET (object), g_value_get_param (&param_values[1]));
+
+  return TRUE;
+}
+
+/* Emission hooks are only installed while there are tree subscriptions */
+static void
+clippy_tree_hooks_update (Clippy *clip)
+{
+  gboolean needed = clip->tree_subs && g_hash_table_size (clip->tree_subs);
+  guint parent_set_id = g_signal_lookup ("parent-set", GTK_TYPE_WIDGET);
+
+  if (needed && !clip->parent_set_hook)
+    {
+      clip->parent_set_hook = g_signal_add_emission_hook (parent_set_id, 0,
+                                                          tree_parent_set_emission,
+                                                          clip, NULL);
+      clip->tree_notify_hook = g_signal_add_emission_hook (notify_signal_id, 0,
+                                                           tree_notify_emission,
+                                                           clip, NULL);
+    }
+  else if (!needed && clip->parent_set_hook)
+    {
+      g_signal_remove_emission_hook (parent_set_id, clip->parent_set_hook);
+      g_signal_remove_emission_hook (notify_signal_id, clip->tree_notify_hook);
+      clip->parent_set_hook = clip->tree_notify_hook = 0;
+    }
+}
+
+/* The subscription ends with its root, which is reported removed */
+static void
+on_tree_sub_root_destroy (GtkWidget *root, ClippyTreeSub *sub)
+{
+  Clippy *clip = sub->clip;
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sssa{sv})"));
+  tree_sub_add_delta (sub, &builder, "removed", root, NULL, 0);
+
+  clippy_emit_signal (clip, CLIPPY_EVENT_PRIORITY_HIGH, NULL,
+                      "TreeChanged", "(ua(sssa{sv}))",
+                      sub->id,
+                      &builder);
+
+  g_hash_table_remove (clip->tree_subs, GUINT_TO_POINTER (sub->id));
+  clippy_tree_hooks_update (clip);
+}
+
+static void
+clippy_subscribe_tree (Clippy       *clip,
+                       const gchar  *object,
+                       GStrv         properties,
+                       GVariant    **return_value,
+                       GError      **error)
+{
+  ClippyTreeSub *sub;
+  GObject *gobject;
+  guint i;
+
+  g_debug ("%s %s", __func__, object);
+
+  if (!app_get_object_info (object, NULL, NULL, &gobject, NULL, NULL, error))
+    return;
+
+  clippy_return_if_fail (GTK_IS_WIDGET (gobject),
+                         error, CLIPPY_NOT_A_WIDGET,
+                         "Object '%s' of type %s is not a GtkWidget",
+                         object,
+                         G_OBJECT_TYPE_NAME (gobject));
+
+  /* Changed properties are tracked in a 64 bit mask */
+  clippy_return_if_fail (g_strv_length (properties) <= 64,
+                         error, CLIPPY_WRONG_OPTION,
+                         "SubscribeTree supports up to 64 properties, got %u",
+                         g_strv_length (properties));
+
+  /* Only notifications of the widget itself are tracked */
+  for (i = 0; properties[i]; i++)
+    clippy_return_if_fail (!g_strstr_len (properties[i], -1, "."),
+                           error, CLIPPY_WRONG_OPTION,
+                           "Property paths like '%s' are not supported, use plain property names",
+                           properties[i]);
+
+  sub = g_new0 (ClippyTreeSub, 1);
+  sub->clip = clip;
+  sub->id = ++clip->last_tree_sub;
+  sub->root = g_object_ref (GTK_WIDGET (gobject));
+  sub->destroy_id = g_signal_connect (sub->root, "destroy",
+                                      G_CALLBACK (on_tree_sub_root_destroy),
+                                      sub);
+  sub->properties = g_strdupv (properties);
+  sub->deltas = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) tree_delta_free);
+
+  g_hash_table_insert (clip->tree_subs, GUINT_TO_POINTER (sub->id), sub);
+  clippy_tree_hooks_update (clip);
+
+  if (return_value)
+    *return_value = g_variant_new ("(u)", sub->id);
+}
+
+static void
+clippy_unsubscribe_tree (Clippy *clip, guint id, GError **error)
+{
+  clippy_return_if_fail (g_hash_table_remove (clip->tree_subs, GUINT_TO_POINTER (id)),
+                         error, CLIPPY_NO_OBJECT,
+                         "No tree subscription with id %u",
+                         id);
+
+  clippy_tree_hooks_update (clip);
+}
+
+typedef struct
+{
+  gdouble   scale;
+  gdouble   offset;
+  GVariant *map;    /* a(vv) source, target value pairs */
+} ClippyBindTransform;
+
+static void
+bind_transform_free (ClippyBindTransform *transform)
+{
+  g_clear_pointer (&transform->map, g_variant_unref);
+  g_free (transform);
+}
+
+static gboolean
+bind_transform (const GValue        *from_value,
+                GValue              *to_value,
+                ClippyBindTransform *transform,
+                gboolean             inverse)
+{
+  g_autoptr(GVariant) variant = g_variant_ref_sink (variant_new_value (from_value));
+  gdouble number;
+
+  if (transform->map)
+    {
+      GVariantIter iter;
+      GVariant *from, *to;
+
+      g_variant_iter_init (&iter, transform->map);
+      while (g_variant_iter_next (&iter, "(vv)", &from, &to))
+        {
+          gboolean match = variant_equal_value (variant, inverse ? to : from);
+
+          if (match)
+            {
+              g_variant_unref (variant);
+              variant = g_variant_ref (inverse ? from : to);
+            }
+
+          g_variant_unref (from);
+          g_variant_unref (to);
+
+          if (match)
+            break;
+        }
+    }
+
+  if ((transform->scale != 1.0 || transform->offset != 0.0) &&
+      variant_get_number (variant, &number))
+    {
+      number = (inverse) ? (number - transform->offset) / transform->scale :
+                           number * transform->scale + transform->offset;
+
+      g_variant_unref (variant);
+      variant = g_variant_ref_sink (g_variant_new_double (number));
+    }
+
+  return value_set_variant (to_value, variant);
+}
+
+static gboolean
+bind_transform_to (GBinding     *binding,
+                   const GValue *from_value,
+                   GValue       *to_value,
+                   gpointer      data)
+{
+  return bind_transform (from_value, to_value, data, FALSE);
+}
+
+static gboolean
+bind_transform_from (GBinding     *binding,
+                     const GValue *from_value,
+                     GValue       *to_value,
+                     gpointer      data)
+{
+  return bind_transform (from_value, to_value, data, TRUE);
+}
+
+static void
+clippy_bind (Clippy       *clip,
+             const gchar  *source,
+             const gchar  *source_property,
+             const gchar  *target,
+             const gchar  *target_property,
+             const gchar **flag_names,
+             GVariant     *transform,
+             GVariant    **return_value,
+             GError      **error)
+{
+  static const gchar *names[] = { "bidirectional", "sync-create", "invert-boolean", NULL };
+  ClippyBindTransform *data = NULL;
+  GBindingFlags flags = 0;
+  GObject *source_object, *target_object;
+  GParamSpec *pspec;
+  GBinding *binding;
+  ClippyBinding *bind;
+  gint i, j;
+
+  g_debug ("%s %s.%s %s.%s", __func__, source, source_property, target, target_property);
+
+  if (!app_get_object_info (source, source_property, NULL,
+                            &source_object, &pspec, NULL, error) ||
+      !app_get_object_info (target, target_property, NULL,
+                            &target_object, &pspec, NULL, error))
+    return;
+
+  /* GBindingFlags values are 1 << index in names */
+  for (i = 0; flag_names[i]; i++)
+    {
+      for (j = 0; names[j]; j++)
+        if (g_strcmp0 (flag_names[i], names[j]) == 0)
+          break;
+
+      clippy_return_if_fail (names[j],
+                             error, CLIPPY_WRONG_OPTION,
+                             "Unknown binding flag '%s'",
+                             flag_names[i]);
+      flags |= 1 << j;
+    }
+
+  if (g_variant_n_children (transform))
+    {
+      data = g_new0 (ClippyBindTransform, 1);
+      data->scale = 1.0;
+      g_variant_lookup (transform, "scale", "d", &data->scale);
+      g_variant_lookup (transform, "offset", "d", &data->offset);
+      data->map = g_variant_lookup_value (transform, "map", G_VARIANT_TYPE ("a(vv)"));
+
+      if (data->scale == 0.0)
+        {
+          bind_transform_free (data);
+          g_set_error_literal (error, CLIPPY_ERROR, CLIPPY_WRONG_OPTION,
+                               "Binding scale can not be 0");
+          return;
+        }
+    }
+
+  binding = g_object_bind_property_full (source_object, source_property,
+                                         target_object, target_property,
+                                         flags,
+                                         data ? bind_transform_to : NULL,
+                                         data ? bind_transform_from : NULL,
+                                         data,
+                                         (GDestroyNotify) (data ? bind_transform_free : NULL));
+
+  clippy_return_if_fail (binding,
+                         error, CLIPPY_NO_PROPERTY,
+                         "Could not bind '%s.%s' to '%s.%s'",
+                         source, source_property,
+                         target, target_property);
+
+  bind = g_new0 (ClippyBinding, 1);
+  bind->clip = clip;
+  bind->id = ++clip->last_binding;
+  bind->binding = binding;
+  g_object_weak_ref (G_OBJECT (binding), on_binding_finalized, bind);
+
+  g_hash_table_insert (clip->bindings, GUINT_TO_POINTER (bind->id), bind);
+
+  if (return_value)
+    *return_value = g_variant_new ("(u)", bind->id);
+}
+
+static void
+clippy_unbind (Clippy *clip, guint id, GError **error)
+{
+  ClippyBinding *bind;
+  GBinding *binding;
+
+  g_debug ("%s %u", __func__, id);
+
+  clippy_return_if_fail ((bind = g_hash_table_lookup (clip->bindings, GUINT_TO_POINTER (id))),
+                         error, CLIPPY_NO_OBJECT,
+                         "No binding with id %u",
+                         id);
+
+  /* Bindings in the table are always alive, unbinding finalizes it */
+  binding = bind->binding;
+  g_hash_table_remove (clip->bindings, GUINT_TO_POINTER (id));
+  g_binding_unbind (binding);
+}
+
+/*
+ * Reply to @wait if the property matches its predicate, or with the last
+ * value on @timeout. Returns TRUE if @wait was replied and freed.
+ */
+static gboolean
+clippy_wait_check (ClippyWait *wait, gboolean timeout)
+{
+  g_auto(GValue) value = G_VALUE_INIT;
+  gboolean matched;
+
+  g_value_init (&value, wait->pspec->value_type);
+  g_object_get_property (wait->object, wait->pspec->name, &value);
+
+  matched = clippy_predicate_eval (wait->predicate, &value);
+
+  if (!matched && !timeout)
+    return FALSE;
+
+  g_dbus_method_invocation_return_value (g_steal_pointer (&wait->invocation),
+                                         g_variant_new ("(bv)",
+                                                        matched,
+                                                        pspec_variant_new_value (wait->pspec, &value)));
+  g_hash_table_remove (wait->clip->waits, wait);
+
+  return TRUE;
+}
+
+static void
+on_wait_notify (GObject *object, GParamSpec *pspec, ClippyWait *wait)
+{
+  clippy_wait_check (wait, FALSE);
+}
+
+static gboolean
+on_wait_timeout (gpointer data)
+{
+  ClippyWait *wait = data;
+
+  wait->timeout_id = 0;
+  clippy_wait_check (wait, TRUE);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Nobody to reply to, drop the wait */
+static void
+on_wait_caller_vanished (GDBusConnection *connection,
+                         const gchar     *name,
+                         gpointer         user_data)
+{
+  ClippyWait *wait = user_data;
+
+  g_debug ("%s %s", __func__, name);
+
+  g_clear_object (&wait->invocation);
+  g_hash_table_remove (wait->clip->waits, wait);
+}
+
+/*
+ * Reply to @invocation once @property matches @predicate, without the
+ * client polling with Get. Returns TRUE if it took care of @invocation.
+ */
+static gboolean
+clippy_wait_for (Clippy                 *clip,
+                 GDBusMethodInvocation  *invocation,
+                 const gchar            *object,
+                 const gchar            *property,
+                 GVariant               *predicate,
+                 guint                   timeout,
+                 GError                **error)
+{
+  g_autofree gchar *detailed_signal = NULL;
+  const gchar *sender;
+  ClippyPredicate *pred;
+  ClippyWait *wait;
+  GObject *gobject;
+  GParamSpec *pspec;
+
+  g_debug ("%s %s %s %u", __func__, object, property, timeout);
+
+  if (!app_get_object_info (object, property, NULL,
+                            &gobject, &pspec, NULL, error) ||
+      !(pred = clippy_predicate_new (predicate, error)))
+    return FALSE;
+
+  wait = g_new0 (ClippyWait, 1);
+  wait->clip = clip;
+  wait->invocation = invocation;
+  wait->object = g_object_ref (gobject);
+  wait->pspec = pspec;
+  wait->predicate = pred;
+  g_hash_table_add (clip->waits, wait);
+
+  /* Check current value first */
+  if (clippy_wait_check (wait, FALSE))
+    return TRUE;
+
+  detailed_signal = g_strconcat ("notify::", pspec->name, NULL);
+  wait->handler_id = g_signal_connect (gobject, detailed_signal,
+                                       G_CALLBACK (on_wait_notify),
+                                       wait);
+
+  /* Never wait longer than the caller would wait for the reply by default */
+  wait->timeout_id = g_timeout_add (timeout ? timeout : WAIT_FOR_DEFAULT_TIMEOUT,
+                                    on_wait_timeout, wait);
+
+  if ((sender = g_dbus_method_invocation_get_sender (invocation)))
+    wait->watch_id = g_bus_watch_name_on_connection (g_dbus_method_invocation_get_connection (invocation),
+                                                     sender,
+                                                     G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                     NULL,
+                                                     on_wait_caller_vanished,
+                                                     wait,
+                                                     NULL);
+  return TRUE;
+}
+
+/* Methods a trigger can run in process */
+static const gchar *trigger_actions[] = {
+  "Highlight",
+  "Unhighlight",
+  "Message",
+  "MessageClear",
+  "Set",
+  NULL
+};
+
+static gboolean
+trigger_actions_validate (GVariant *actions, GError **error)
+{
+  GVariantIter iter;
+  const gchar *method;
+  GVariant *params;
+
+  g_variant_iter_init (&iter, actions);
+  while (g_variant_iter_next (&iter, "(&sv)", &method, &params))
+    {
+      g_autoptr(GVariant) owned = params;
+      g_autoptr(GPtrArray) args = g_ptr_array_new ();
+      g_autoptr(GVariantType) type = NULL;
+      GDBusMethodInfo *info;
+      gint i;
+
+      clippy_return_val_if_fail (g_strv_contains (trigger_actions, method),
+                                 FALSE, error, CLIPPY_WRONG_OPTION,
+                                 "Method '%s' can not be used as a trigger action",
+                                 method);
+
+      /* Build the method input signature to check parameters */
+      info = g_dbus_interface_info_lookup_method (iface_info, method);
+      for (i = 0; info->in_args && info->in_args[i]; i++)
+        g_ptr_array_add (args, (gpointer) G_VARIANT_TYPE (info->in_args[i]->signature));
+
+      type = g_variant_type_new_tuple ((const GVariantType * const *) args->pdata, args->len);
+
+      clippy_return_val_if_fail (g_variant_is_of_type (params, type),
+                                 FALSE, error, CLIPPY_WRONG_OPTION,
+                                 "Wrong parameters type '%s' for action %s",
+                                 g_variant_get_type_string (params),
+                                 method);
+    }
+
+  return TRUE;
+}
+
+static void
+clippy_add_trigger (Clippy    *clip,
+                    GVariant  *event,
+                    GVariant  *actions,
+                    GVariant **return_value,
+                    GError   **error)
+{
+  const gchar *object = NULL, *signal = NULL, *detail = NULL;
+  ClippySubscription *sub;
+  ClippyTrigger *trigger;
+  GObject *gobject;
+  gulong handler_id;
+
+  g_variant_lookup (event, "object", "&s", &object);
+  g_variant_lookup (event, "signal", "&s", &signal);
+  g_variant_lookup (event, "detail", "&s", &detail);
+
+  clippy_return_if_fail (object && signal,
+                         error, CLIPPY_WRONG_OPTION,
+                         "Trigger event requires %s",
+                         object ? "signal" : "object");
+
+  if (!trigger_actions_validate (actions, error) ||
+      !(sub = clippy_subscription_new_from_options (clip, event, event_options, error)))
+    return;
+
+  sub->actions = g_variant_ref (actions);
+  sub->trigger = clip->last_trigger + 1;
+
+  if (!(handler_id = clippy_connect (clip, object, signal, detail, sub, &gobject, error)))
+    return;
+
+  trigger = g_new0 (ClippyTrigger, 1);
+  trigger->object = g_object_ref (gobject);
+  trigger->handler_id = handler_id;
+
+  g_hash_table_insert (clip->triggers, GUINT_TO_POINTER (++clip->last_trigger), trigger);
+
+  if (return_value)
+    *return_value = g_variant_new ("(u)", clip->last_trigger);
+}
+
+static void
+clippy_remove_trigger (Clippy *clip, guint id, GError **error)
+{
+  clippy_return_if_fail (g_hash_table_remove (clip->triggers, GUINT_TO_POINTER (id)),
+                         error, CLIPPY_NO_OBJECT,
+                         "No trigger with id %u",
+                         id);
+}
+
+static ClippyLessonStep *
+lesson_steps_lookup (GPtrArray *steps, const gchar *id)
+{
+  guint i;
+
+  for (i = 0; i < steps->len; i++)
+    {
+      ClippyLessonStep *step = g_ptr_array_index (steps, i);
+
+      if (g_strcmp0 (step->id, id) == 0)
+        return step;
+    }
+
+  return NULL;
+}
+
+static void clippy_lesson_enter (ClippyLesson     *lesson,
+                                 ClippyLessonStep *step,
+                                 const gchar      *outcome);
+
+static gboolean
+lesson_advance_idle (gpointer data)
+{
+  ClippyLesson *lesson = data;
+  const gchar *id = NULL;
+
+  lesson->advance_id = 0;
+
+  g_variant_lookup (lesson->current->next, lesson->outcome, "&s", &id);
+  clippy_lesson_enter (lesson,
+                       id ? lesson_steps_lookup (lesson->steps, id) : NULL,
+                       lesson->outcome);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Finish the current step, the transition happens in an idle so that the
+ * next step is not connected in the middle of the emission that ended it.
+ */
+static void
+clippy_lesson_step_done (ClippyLesson *lesson, const gchar *outcome)
+{
+  if (lesson->advance_id || !lesson->current)
+    return;
+
+  g_debug ("%s %s %s %s", __func__, lesson->name, lesson->current->id, outcome);
+
+  clippy_lesson_cancel_wait (lesson);
+
+  lesson->outcome = outcome;
+  lesson->advance_id = g_idle_add_full (G_PRIORITY_HIGH, lesson_advance_idle, lesson, NULL);
+}
+
+static gboolean
+lesson_timeout (gpointer data)
+{
+  ClippyLesson *lesson = data;
+
+  lesson->timeout_id = 0;
+  clippy_lesson_step_done (lesson, LESSON_OUTCOME_TIMEOUT);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+clippy_lesson_wait (ClippyLesson *lesson, ClippyLessonStep *step)
+{
+  const gchar *object = NULL, *signal = NULL, *detail = NULL;
+  g_autoptr(GError) error = NULL;
+  guint timeout = 0;
+
+  g_variant_lookup (step->wait, "object", "&s", &object);
+  g_variant_lookup (step->wait, "signal", "&s", &signal);
+  g_variant_lookup (step->wait, "detail", "&s", &detail);
+  g_variant_lookup (step->wait, "timeout", "u", &timeout);
+
+  if (object)
+    {
+      ClippySubscription *sub;
+      GObject *gobject;
+      gulong handler_id;
+
+      if (!(sub = clippy_subscription_new_from_options (lesson->clip, step->wait, wait_options, &error)) ||
+          !(handler_id = clippy_connect (lesson->clip, object, signal, detail,
+                                         sub, &gobject, &error)))
+        {
+          g_warning ("Lesson %s step %s can not wait: %s",
+                     lesson->name, step->id, error->message);
+          clippy_lesson_step_done (lesson, LESSON_OUTCOME_ERROR);
+          return;
+        }
+
+      sub->lesson = lesson;
+      lesson->sub = sub;
+      lesson->object = g_object_ref (gobject);
+      lesson->handler_id = handler_id;
+    }
+
+  if (timeout)
+    lesson->timeout_id = g_timeout_add (timeout, lesson_timeout, lesson);
+
+  /* Nothing to wait for, move on */
+  if (!object && !timeout)
+    clippy_lesson_step_done (lesson, LESSON_OUTCOME_DONE);
+}
+
+static void
+clippy_lesson_enter (ClippyLesson     *lesson,
+                     ClippyLessonStep *step,
+                     const gchar      *outcome)
+{
+  const gchar *from = lesson->current ? lesson->current->id : "";
+
+  clippy_emit_signal (lesson->clip,
+                      CLIPPY_EVENT_PRIORITY_HIGH,
+                      NULL,
+                      "LessonStep",
+                      "(ssss)",
+                      lesson->name,
+                      from,
+                      outcome,
+                      step ? step->id : "");
+
+  lesson->current = step;
+
+  /* Lesson finished */
+  if (!step)
+    return;
+
+  clippy_run_actions (lesson->clip, step->actions);
+  clippy_lesson_wait (lesson, step);
+}
+
+static void
+clippy_lesson_stop (ClippyLesson *lesson)
+{
+  clippy_lesson_cancel_wait (lesson);
 
-  g_debug ("%s is action %s %s n_params %d n_children %ld", __func__,
-           object,
-           signal,
-           query.n_params,
-           (params) ? g_variant_n_children (params) : 0);
+  if (lesson->advance_id)
+    {
+      g_source_remove (lesson->advance_id);
+      lesson->advance_id = 0;
+    }
 
-  object_emit_action_signal (gobject, &query, detail, params, error);
+  if (lesson->current)
+    clippy_lesson_enter (lesson, NULL, LESSON_OUTCOME_STOPPED);
 }
 
 static void
-clippy_export (Clippy       *clip,
-               const gchar  *object,
-               GVariant    **return_value,
-               GError      **error)
+clippy_lesson_load (Clippy       *clip,
+                    const gchar  *name,
+                    GVariant     *steps,
+                    GError      **error)
 {
-  g_autoptr(GDBusObjectSkeleton) skeleton = NULL;
-  g_autoptr(ClippyDbusWrapper) interface = NULL;
-  g_autofree gchar *object_path = NULL;
-  g_autoptr(GString) node_info = NULL;
-  GDBusInterfaceInfo *info;
-  GObject *gobject;
+  g_autoptr(GPtrArray) program = NULL;
+  GVariant *actions, *wait, *next;
+  ClippyLesson *lesson, *previous;
+  ClippyLessonStep *step;
+  GVariantIter iter;
+  const gchar *id;
+  guint i;
 
-  g_debug ("%s %s", __func__, object);
+  program = g_ptr_array_new_with_free_func ((GDestroyNotify) lesson_step_free);
 
-  if (!app_get_object_info (object, NULL, NULL, &gobject, NULL, NULL, error))
-    return;
+  g_variant_iter_init (&iter, steps);
+  while (g_variant_iter_next (&iter, "(&s@a(sv)@a{sv}@a{ss})", &id, &actions, &wait, &next))
+    {
+      g_autoptr(ClippySubscription) sub = NULL;
+      const gchar *object = NULL, *signal = NULL;
+      gboolean duplicated = lesson_steps_lookup (program, id) != NULL;
 
-  object_path = g_build_path ("/", DBUS_OBJECT_PATH, "objects", object, NULL);
+      step = g_new0 (ClippyLessonStep, 1);
+      step->id = g_strdup (id);
+      step->actions = actions;
+      step->wait = wait;
+      step->next = next;
+      g_ptr_array_add (program, step);
 
-  /* Replace dots with slashes */
-  str_replace_char (object_path, '.', '/');
+      clippy_return_if_fail (*id && !duplicated,
+                             error, CLIPPY_WRONG_OPTION,
+                             "Wrong or duplicated step id '%s'",
+                             id);
 
-  skeleton = g_dbus_object_skeleton_new (object_path);
-  clippy_return_if_fail (skeleton,
-                         error, CLIPPY_NO_OBJECT,
-                         "Could not create dbus skeleton for object '%s'",
-                         object);
+      g_variant_lookup (wait, "object", "&s", &object);
+      g_variant_lookup (wait, "signal", "&s", &signal);
 
-  interface = clippy_dbus_wrapper_new (gobject, object_path);
+      clippy_return_if_fail (!object == !signal,
+                             error, CLIPPY_WRONG_OPTION,
+                             "Step %s needs both object and signal to wait on",
+                             id);
 
-  /* We need to increment  the reference count of the dynamic info struct since
-   * DBus will try to unref it when unexporting it!
-   */
-  info = g_dbus_interface_skeleton_get_info (G_DBUS_INTERFACE_SKELETON (interface));
-  g_dbus_interface_info_ref (info);
+      /* Make sure actions and wait options are valid before running anything */
+      if (!trigger_actions_validate (actions, error) ||
+          !(sub = clippy_subscription_new_from_options (clip, wait, wait_options, error)))
+        return;
+    }
 
-  g_dbus_object_skeleton_add_interface (skeleton, G_DBUS_INTERFACE_SKELETON (interface));
-  g_dbus_object_manager_server_export (clip->manager, skeleton);
+  clippy_return_if_fail (program->len,
+                         error, CLIPPY_WRONG_OPTION,
+                         "Lesson %s has no steps",
+                         name);
 
-  clippy_return_if_fail (g_dbus_object_manager_server_is_exported(clip->manager, skeleton),
+  lesson = g_new0 (ClippyLesson, 1);
+  lesson->clip = clip;
+  lesson->name = g_strdup (name);
+  lesson->steps = g_steal_pointer (&program);
+
+  /* Check transitions */
+  for (i = 0; i < lesson->steps->len; i++)
+    {
+      const gchar *outcome;
+
+      step = g_ptr_array_index (lesson->steps, i);
+      g_variant_iter_init (&iter, step->next);
+
+      while (g_variant_iter_next (&iter, "{&s&s}", &outcome, &id))
+        {
+          if (!*id || lesson_steps_lookup (lesson->steps, id))
+            continue;
+
+          g_set_error (error, CLIPPY_ERROR, CLIPPY_WRONG_OPTION,
+                       "Step %s goes to unknown step %s on %s",
+                       step->id, id, outcome);
+          clippy_lesson_free (lesson);
+          return;
+        }
+    }
+
+  /* Replace any previous lesson with the same name */
+  if ((previous = g_hash_table_lookup (clip->lessons, name)))
+    clippy_lesson_stop (previous);
+
+  g_hash_table_replace (clip->lessons, lesson->name, lesson);
+}
+
+static void
+clippy_lesson_start (Clippy       *clip,
+                     const gchar  *name,
+                     const gchar  *step_id,
+                     GError      **error)
+{
+  ClippyLessonStep *step;
+  ClippyLesson *lesson;
+
+  clippy_return_if_fail ((lesson = g_hash_table_lookup (clip->lessons, name)),
                          error, CLIPPY_NO_OBJECT,
-                         "Could not export object '%s' on dbus path '%s'",
-                         object,
-                         g_dbus_object_get_object_path (G_DBUS_OBJECT (skeleton)));
+                         "No lesson named %s",
+                         name);
 
-  node_info = g_string_new ("<node xmlns:doc=\"http://www.freedesktop.org/dbus/1.0/doc.dtd\">\n");
-  g_dbus_interface_info_generate_xml (info, 2, node_info);
-  g_string_append (node_info,"</node>");
+  step = *step_id ? lesson_steps_lookup (lesson->steps, step_id) :
+                    g_ptr_array_index (lesson->steps, 0);
 
-  if (return_value)
-    *return_value = g_variant_new ("(ss)", object_path, node_info->str);
+  clippy_return_if_fail (step,
+                         error, CLIPPY_NO_OBJECT,
+                         "Lesson %s has no step %s",
+                         name, step_id);
+
+  clippy_lesson_stop (lesson);
+  clippy_lesson_enter (lesson, step, "");
 }
 
 static void
-clippy_method_call (GDBusConnection       *connection,
-                    const gchar           *sender,
-                    const gchar           *object_path,
-                    const gchar           *interface_name,
-                    const gchar           *method_name,
-                    GVariant              *parameters,
-                    GDBusMethodInvocation *invocation,
-                    gpointer               user_data)
+clippy_lesson_stop_by_name (Clippy *clip, const gchar *name, GError **error)
 {
-  GVariant *return_value = NULL;
-  Clippy *clip = user_data;
-  GError *error = NULL;
-  GApplication *app;
+  ClippyLesson *lesson;
 
-  /* Make sure the app is activated in case it was autostarted
-   * through this method call.
-   */
-  app = g_application_get_default ();
-  if (app && !gtk_application_get_active_window (GTK_APPLICATION (app)))
-    g_application_activate (app);
+  clippy_return_if_fail ((lesson = g_hash_table_lookup (clip->lessons, name)),
+                         error, CLIPPY_NO_OBJECT,
+                         "No lesson named %s",
+                         name);
+
+  clippy_lesson_stop (lesson);
+}
 
+/*
+ * Run any method that replies right away, used for DBus calls and triggers
+ * actions.
+ */
+static void
+clippy_call (Clippy       *clip,
+             const gchar  *method_name,
+             GVariant     *parameters,
+             GVariant    **return_value,
+             GError      **error)
+{
   if (g_strcmp0 (method_name, "Highlight") == 0)
     {
       g_autofree gchar *object = NULL;
       guint timeout;
 
       g_variant_get (parameters, "(su)", &object, &timeout);
-      clippy_highlight (clip, object, timeout, &error);
+      clippy_highlight (clip, object, timeout, error);
     }
   else if (g_strcmp0 (method_name, "Unhighlight") == 0)
     {
       g_autofree gchar *object = NULL;
 
       g_variant_get (parameters, "(s)", &object);
-      clippy_unhighlight (clip, object, &error);
+      clippy_unhighlight (clip, object, error);
     }
   else if (g_strcmp0 (method_name, "Message") == 0)
     {
@@ -592,13 +4920,13 @@ clippy_method_call (GDBusConnection       *connection,
       guint timeout;
 
       g_variant_get (parameters, "(ssssu)", &id, &text, &image, &relative_to, &timeout);
-      clippy_message (clip, id, text, image, relative_to, timeout, &error);
+      clippy_message (clip, id, text, image, relative_to, timeout, error);
     }
   if (g_strcmp0 (method_name, "MessageClear") == 0)
     {
       g_autofree gchar *id = NULL;
       g_variant_get (parameters, "(s)", &id);
-      clippy_message_clear (clip, id, &error);
+      clippy_message_clear (clip, id, error);
     }
   else if (g_strcmp0 (method_name, "Set") == 0)
     {
@@ -606,21 +4934,46 @@ clippy_method_call (GDBusConnection       *connection,
       g_autoptr(GVariant) value = NULL;
 
       g_variant_get (parameters, "(ssv)", &object, &property, &value);
-      clippy_set (clip, object, property, value, &error);
+      clippy_set (clip, object, property, value, error);
     }
   else if (g_strcmp0 (method_name, "Get") == 0)
     {
       g_autofree gchar *object = NULL, *property = NULL;
 
       g_variant_get (parameters, "(ss)", &object, &property);
-      clippy_get (clip, object, property, &return_value, &error);
+      clippy_get (clip, object, property, return_value, error);
     }
   else if (g_strcmp0 (method_name, "Connect") == 0)
     {
       g_autofree gchar *object = NULL, *signal = NULL, *detail = NULL;
 
       g_variant_get (parameters, "(sss)", &object, &signal, &detail);
-      clippy_connect (clip, object, signal, detail, &error);
+      clippy_connect (clip, object, signal, detail, NULL, NULL, error);
+    }
+  else if (g_strcmp0 (method_name, "ConnectFull") == 0)
+    {
+      g_autofree gchar *object = NULL, *signal = NULL, *detail = NULL;
+      g_autoptr(GVariant) options = NULL;
+      ClippySubscription *sub;
+
+      g_variant_get (parameters, "(sss@a{sv})", &object, &signal, &detail, &options);
+
+      if ((sub = clippy_subscription_new_from_options (clip, options, NULL, error)))
+        clippy_connect (clip, object, signal, detail, sub, NULL, error);
+    }
+  else if (g_strcmp0 (method_name, "ConnectType") == 0)
+    {
+      g_autofree gchar *type = NULL, *signal = NULL, *detail = NULL;
+
+      g_variant_get (parameters, "(sss)", &type, &signal, &detail);
+      clippy_connect_type (clip, type, signal, detail, error);
+    }
+  else if (g_strcmp0 (method_name, "DisconnectType") == 0)
+    {
+      g_autofree gchar *type = NULL, *signal = NULL, *detail = NULL;
+
+      g_variant_get (parameters, "(sss)", &type, &signal, &detail);
+      clippy_disconnect_type (clip, type, signal, detail, error);
     }
   else if (g_strcmp0 (method_name, "Emit") == 0)
     {
@@ -628,15 +4981,270 @@ clippy_method_call (GDBusConnection       *connection,
       g_autoptr(GVariant) params = NULL;
 
       g_variant_get (parameters, "(ssv)", &signal, &detail, &params);
-      clippy_emit (clip, signal, detail, params, &error);
+      clippy_emit (clip, signal, detail, params, NULL, NULL, error);
+    }
+  else if (g_strcmp0 (method_name, "EmitWithResult") == 0)
+    {
+      g_autofree gchar *signal = NULL, *detail = NULL;
+      g_autoptr(GVariant) params = NULL;
+      g_auto(GStrv) properties = NULL;
+
+      g_variant_get (parameters, "(ssv^as)", &signal, &detail, &params, &properties);
+      clippy_emit (clip, signal, detail, params, properties, return_value, error);
+    }
+  else if (g_strcmp0 (method_name, "GetEventsSince") == 0)
+    {
+      guint64 sequence;
+
+      g_variant_get (parameters, "(t)", &sequence);
+      *return_value = clippy_events_get_since (clip->events, sequence);
+    }
+  else if (g_strcmp0 (method_name, "TapInput") == 0)
+    {
+      g_autofree gchar *object = NULL;
+      g_autofree const gchar **events = NULL;
+
+      g_variant_get (parameters, "(s^a&s)", &object, &events);
+      clippy_tap_input (clip, object, events, error);
+    }
+  else if (g_strcmp0 (method_name, "UntapInput") == 0)
+    {
+      g_autofree gchar *object = NULL;
+
+      g_variant_get (parameters, "(s)", &object);
+      clippy_untap_input (clip, object, error);
+    }
+  else if (g_strcmp0 (method_name, "WatchGeometry") == 0)
+    {
+      g_autofree gchar *object = NULL;
+
+      g_variant_get (parameters, "(s)", &object);
+      clippy_watch_geometry (clip, object, error);
+    }
+  else if (g_strcmp0 (method_name, "UnwatchGeometry") == 0)
+    {
+      g_autofree gchar *object = NULL;
+
+      g_variant_get (parameters, "(s)", &object);
+      clippy_unwatch_geometry (clip, object, error);
+    }
+  else if (g_strcmp0 (method_name, "Bind") == 0)
+    {
+      g_autofree gchar *source = NULL, *source_property = NULL;
+      g_autofree gchar *target = NULL, *target_property = NULL;
+      g_autofree const gchar **flags = NULL;
+      g_autoptr(GVariant) transform = NULL;
+
+      g_variant_get (parameters, "(ssss^a&s@a{sv})",
+                     &source, &source_property,
+                     &target, &target_property,
+                     &flags, &transform);
+      clippy_bind (clip, source, source_property, target, target_property,
+                   flags, transform, return_value, error);
+    }
+  else if (g_strcmp0 (method_name, "Unbind") == 0)
+    {
+      guint id;
+
+      g_variant_get (parameters, "(u)", &id);
+      clippy_unbind (clip, id, error);
+    }
+  else if (g_strcmp0 (method_name, "AddTrigger") == 0)
+    {
+      g_autoptr(GVariant) event = NULL, actions = NULL;
+
+      g_variant_get (parameters, "(@a{sv}@a(sv))", &event, &actions);
+      clippy_add_trigger (clip, event, actions, return_value, error);
+    }
+  else if (g_strcmp0 (method_name, "RemoveTrigger") == 0)
+    {
+      guint id;
+
+      g_variant_get (parameters, "(u)", &id);
+      clippy_remove_trigger (clip, id, error);
+    }
+  else if (g_strcmp0 (method_name, "LessonLoad") == 0)
+    {
+      g_autofree gchar *name = NULL;
+      g_autoptr(GVariant) steps = NULL;
+
+      g_variant_get (parameters, "(s@a(sa(sv)a{sv}a{ss}))", &name, &steps);
+      clippy_lesson_load (clip, name, steps, error);
+    }
+  else if (g_strcmp0 (method_name, "LessonStart") == 0)
+    {
+      g_autofree gchar *name = NULL, *step = NULL;
+
+      g_variant_get (parameters, "(ss)", &name, &step);
+      clippy_lesson_start (clip, name, step, error);
+    }
+  else if (g_strcmp0 (method_name, "LessonStop") == 0)
+    {
+      g_autofree gchar *name = NULL;
+
+      g_variant_get (parameters, "(s)", &name);
+      clippy_lesson_stop_by_name (clip, name, error);
+    }
+  else if (g_strcmp0 (method_name, "Snapshot") == 0)
+    {
+      g_autofree gchar *root = NULL, *type_filter = NULL;
+      g_auto(GStrv) properties = NULL;
+      guint depth;
+
+      g_variant_get (parameters, "(su^ass)", &root, &depth, &properties, &type_filter);
+      clippy_snapshot (clip, root, depth, properties, type_filter, return_value, error);
+    }
+  else if (g_strcmp0 (method_name, "GetRows") == 0)
+    {
+      g_autofree gchar *object = NULL;
+      g_auto(GStrv) columns = NULL;
+      guint offset, count;
+
+      g_variant_get (parameters, "(suu^as)", &object, &offset, &count, &columns);
+      clippy_get_rows (clip, object, offset, count, columns, return_value, error);
+    }
+  else if (g_strcmp0 (method_name, "WatchRows") == 0)
+    {
+      g_autofree gchar *object = NULL;
+
+      g_variant_get (parameters, "(s)", &object);
+      clippy_watch_rows (clip, object, error);
+    }
+  else if (g_strcmp0 (method_name, "UnwatchRows") == 0)
+    {
+      g_autofree gchar *object = NULL;
+
+      g_variant_get (parameters, "(s)", &object);
+      clippy_unwatch_rows (clip, object, error);
+    }
+  else if (g_strcmp0 (method_name, "GetText") == 0)
+    {
+      g_autofree gchar *object = NULL;
+      gint offset, length;
+
+      g_variant_get (parameters, "(sii)", &object, &offset, &length);
+      clippy_get_text (clip, object, offset, length, return_value, error);
+    }
+  else if (g_strcmp0 (method_name, "WatchText") == 0)
+    {
+      g_autofree gchar *object = NULL;
+
+      g_variant_get (parameters, "(s)", &object);
+      clippy_watch_text (clip, object, error);
+    }
+  else if (g_strcmp0 (method_name, "UnwatchText") == 0)
+    {
+      g_autofree gchar *object = NULL;
+
+      g_variant_get (parameters, "(s)", &object);
+      clippy_unwatch_text (clip, object, error);
+    }
+  else if (g_strcmp0 (method_name, "WidgetAt") == 0)
+    {
+      g_autofree gchar *object = NULL;
+      gint x, y;
+
+      g_variant_get (parameters, "(sii)", &object, &x, &y);
+      clippy_widget_at (clip, object, x, y, return_value, error);
+    }
+  else if (g_strcmp0 (method_name, "WidgetsInRect") == 0)
+    {
+      g_autofree gchar *object = NULL;
+      GdkRectangle rect;
+
+      g_variant_get (parameters, "(s(iiii))", &object,
+                     &rect.x, &rect.y, &rect.width, &rect.height);
+      clippy_widgets_in_rect (clip, object, &rect, return_value, error);
+    }
+  else if (g_strcmp0 (method_name, "SubscribeTree") == 0)
+    {
+      g_autofree gchar *object = NULL;
+      g_auto(GStrv) properties = NULL;
+
+      g_variant_get (parameters, "(s^as)", &object, &properties);
+      clippy_subscribe_tree (clip, object, properties, return_value, error);
+    }
+  else if (g_strcmp0 (method_name, "UnsubscribeTree") == 0)
+    {
+      guint id;
+
+      g_variant_get (parameters, "(u)", &id);
+      clippy_unsubscribe_tree (clip, id, error);
     }
   else if (g_strcmp0 (method_name, "Export") == 0)
     {
       g_autofree gchar *object;
 
       g_variant_get (parameters, "(s)", &object);
-      clippy_export (clip, object, &return_value, &error);
+      clippy_export (clip, object, return_value, error);
+    }
+}
+
+static void
+clippy_method_call (GDBusConnection       *connection,
+                    const gchar           *sender,
+                    const gchar           *object_path,
+                    const gchar           *interface_name,
+                    const gchar           *method_name,
+                    GVariant              *parameters,
+                    GDBusMethodInvocation *invocation,
+                    gpointer               user_data)
+{
+  GVariant *return_value = NULL;
+  Clippy *clip = user_data;
+  GError *error = NULL;
+  GApplication *app;
+
+  /* Make sure the app is activated in case it was autostarted
+   * through this method call.
+   */
+  app = g_application_get_default ();
+  if (app && !gtk_application_get_active_window (GTK_APPLICATION (app)))
+    g_application_activate (app);
+
+  /* Methods that need the invocation */
+  if (g_strcmp0 (method_name, "WaitFor") == 0)
+    {
+      g_autofree gchar *object = NULL, *property = NULL;
+      g_autoptr(GVariant) predicate = NULL;
+      guint timeout;
+
+      g_variant_get (parameters, "(ss@(sv)u)", &object, &property, &predicate, &timeout);
+
+      if (clippy_wait_for (clip, invocation, object, property, predicate, timeout, &error))
+        return;
+    }
+  else if (g_strcmp0 (method_name, "GetFd") == 0)
+    {
+      g_autofree gchar *object = NULL, *property = NULL;
+
+      g_variant_get (parameters, "(ss)", &object, &property);
+
+      if (clippy_get_fd (clip, invocation, object, property, &error))
+        return;
+    }
+  else if (g_strcmp0 (method_name, "GetGeometry") == 0)
+    {
+      g_auto(GStrv) objects = NULL;
+
+      g_variant_get (parameters, "(^as)", &objects);
+
+      if (clippy_get_geometry (clip, invocation, objects, &error))
+        return;
+    }
+  else if (g_strcmp0 (method_name, "SetFd") == 0)
+    {
+      g_autofree gchar *object = NULL, *property = NULL, *type = NULL;
+      GDBusMessage *message = g_dbus_method_invocation_get_message (invocation);
+      gint32 handle;
+
+      g_variant_get (parameters, "(sssh)", &object, &property, &type, &handle);
+      clippy_set_fd (clip, object, property, type, handle,
+                     g_dbus_message_get_unix_fd_list (message),
+                     &error);
     }
+  else
+    clippy_call (clip, method_name, parameters, &return_value, &error);
 
   if (error)
     g_dbus_method_invocation_take_error (invocation, error);
@@ -644,6 +5252,30 @@ clippy_method_call (GDBusConnection       *connection,
     g_dbus_method_invocation_return_value (invocation, return_value);
 }
 
+static GVariant *
+clippy_get_property (GDBusConnection *connection,
+                     const gchar     *sender,
+                     const gchar     *object_path,
+                     const gchar     *interface_name,
+                     const gchar     *property_name,
+                     GError         **error,
+                     gpointer         user_data)
+{
+  Clippy *clip = user_data;
+
+  if (g_strcmp0 (property_name, "EventSender") == 0)
+    {
+      GDBusConnection *events = clippy_events_get_connection (clip->events);
+      return g_variant_new_string (g_dbus_connection_get_unique_name (events));
+    }
+  else if (g_strcmp0 (property_name, "EventSequence") == 0)
+    return g_variant_new_uint64 (clippy_events_get_sequence (clip->events));
+  else if (g_strcmp0 (property_name, "FdThreshold") == 0)
+    return g_variant_new_uint32 (clip->fd_threshold);
+
+  return NULL;
+}
+
 static gboolean
 clippy_set_property (GDBusConnection *connection,
                      const gchar     *sender,
@@ -662,6 +5294,8 @@ clippy_set_property (GDBusConnection *connection,
       g_variant_get (value, "s", &clip->css);
       gtk_css_provider_load_from_data (clip->provider, clip->css, -1, NULL);
     }
+  else if (g_strcmp0 (property_name, "FdThreshold") == 0)
+    clip->fd_threshold = g_variant_get_uint32 (value);
   else
     return FALSE;
   
@@ -673,7 +5307,7 @@ register_clippy_iface (void)
 {
   const static GDBusInterfaceVTable vtable = {
     clippy_method_call,
-    NULL,
+    clippy_get_property,
     clippy_set_property
   };
 
@@ -52,51 +52,271 @@ object_get_name (GObject *object)
   return NULL;
 }
 
+/*
+ * Handles identify objects without a name, "#<n>" strings resolved by
+ * app_get_object() for as long as the object is alive.
+ */
+static GHashTable *handles = NULL; /* Handle -> GObject */
+
+static void
+handle_object_finalized (gpointer data, GObject *where_the_object_was)
+{
+  g_hash_table_remove (handles, data);
+}
+
+const gchar *
+object_get_handle (GObject *object)
+{
+  static GQuark quark = 0;
+  static guint last_handle = 0;
+  gchar *handle;
+
+  if (G_UNLIKELY (!quark))
+    {
+      quark = g_quark_from_static_string ("ClippyHandle");
+      handles = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+  if ((handle = g_object_get_qdata (object, quark)))
+    return handle;
+
+  /* The table owns the string, it is removed when the object goes away */
+  handle = g_strdup_printf ("#%u", ++last_handle);
+  g_hash_table_insert (handles, handle, object);
+  g_object_set_qdata (object, quark, handle);
+  g_object_weak_ref (object, handle_object_finalized, handle);
+
+  return handle;
+}
+
+GObject *
+object_from_handle (const gchar *handle)
+{
+  return handles ? g_hash_table_lookup (handles, handle) : NULL;
+}
+
+/*
+ * Object name if it has one or its handle otherwise
+ */
+const gchar *
+object_get_id (GObject *object)
+{
+  const gchar *name = object_get_name (object);
+  return name ? name : object_get_handle (object);
+}
+
+/*
+ * Per GType cache of property and signal metadata, so that repeated calls
+ * on the same kind of object do not have to look them up again.
+ */
+typedef struct
+{
+  GSignalQuery        query;
+  GType               instance_type;
+  GValue             *values;        /* Reusable instance and parameters buffer */
+  GVariantType      **variant_types; /* Last variant type converted per parameter */
+  VariantToValueFunc *converters;    /* Converter for each parameter */
+  ValueToVariantFunc  return_converter;
+  gboolean            busy;          /* Buffer in use by the current emission */
+} SignalEmitter;
+
+typedef struct
+{
+  GHashTable *properties; /* Property name -> GParamSpec */
+  GHashTable *signals;    /* Signal name -> SignalEmitter */
+} TypeCache;
+
+static TypeCache *
+type_cache_get (GType type)
+{
+  static GQuark quark = 0;
+  TypeCache *cache;
+
+  if (G_UNLIKELY (!quark))
+    quark = g_quark_from_static_string ("ClippyTypeCache");
+
+  if ((cache = g_type_get_qdata (type, quark)))
+    return cache;
+
+  /* Types are never unloaded, the cache lives as long as the type */
+  cache = g_new0 (TypeCache, 1);
+  cache->properties = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  cache->signals = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_type_set_qdata (type, quark, cache);
+
+  return cache;
+}
+
+GParamSpec *
+object_find_property (GObject *object, const gchar *property)
+{
+  TypeCache *cache = type_cache_get (G_OBJECT_TYPE (object));
+  GParamSpec *pspec;
+
+  if ((pspec = g_hash_table_lookup (cache->properties, property)))
+    return pspec;
+
+  if ((pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (object), property)))
+    g_hash_table_insert (cache->properties, g_strdup (property), pspec);
+
+  return pspec;
+}
+
+static SignalEmitter *
+object_get_emitter (GObject *object, const gchar *signal)
+{
+  TypeCache *cache = type_cache_get (G_OBJECT_TYPE (object));
+  SignalEmitter *emitter;
+  guint id;
+
+  if ((emitter = g_hash_table_lookup (cache->signals, signal)))
+    return emitter;
+
+  if (!(id = g_signal_lookup (signal, G_OBJECT_TYPE (object))))
+    return NULL;
+
+  /* The values buffer is only created for action signals on first emission */
+  emitter = g_new0 (SignalEmitter, 1);
+  g_signal_query (id, &emitter->query);
+  emitter->instance_type = G_OBJECT_TYPE (object);
+  g_hash_table_insert (cache->signals, g_strdup (signal), emitter);
+
+  return emitter;
+}
+
+guint
+object_lookup_signal (GObject *object, const gchar *signal)
+{
+  SignalEmitter *emitter = object_get_emitter (object, signal);
+  return emitter ? emitter->query.signal_id : 0;
+}
+
+static void
+signal_emitter_init_values (SignalEmitter *emitter, GValue *values)
+{
+  guint i;
+
+  g_value_init (values, emitter->instance_type);
+
+  for (i = 0; i < emitter->query.n_params; i++)
+    g_value_init (&values[i+1], emitter->query.param_types[i] & ~G_SIGNAL_TYPE_STATIC_SCOPE);
+}
+
+static GVariant *value_unsupported_to_variant (const GValue *value);
+
+/*
+ * Emits @signal on @object, @return_value is set to the marshalled signal
+ * return value or NULL if the signal does not return anything.
+ * Signals returning a type we can not marshal are not emitted when
+ * @return_value is requested.
+ */
 void
 object_emit_action_signal (GObject      *object,
-                           GSignalQuery *signal,
+                           const gchar  *signal,
                            const gchar  *detail,
                            GVariant     *params,
+                           GVariant    **return_value,
                            GError      **error)
 {
   g_auto(GValue) retval = G_VALUE_INIT;
-  g_autoptr(GVariant) variant = NULL;
-  g_autoptr(GArray) values = NULL;
-  GValue *instance_and_params;
+  SignalEmitter *emitter;
+  GSignalQuery *query;
+  gboolean reentrant;
+  GValue *values;
+  guint i;
+
+  clippy_return_if_fail ((emitter = object_get_emitter (object, signal)),
+                         error, CLIPPY_NO_SIGNAL,
+                         "Object '%s' of type %s has no signal '%s'",
+                         object_get_name (object),
+                         G_OBJECT_TYPE_NAME (object),
+                         signal);
+  query = &emitter->query;
 
   /* We only support emiting action signals! */
-  clippy_return_if_fail (signal->signal_flags & G_SIGNAL_ACTION,
+  clippy_return_if_fail (query->signal_flags & G_SIGNAL_ACTION,
                          error, CLIPPY_WRONG_SIGNAL_TYPE,
                          "Can not emit signal '%s' from object '%s' of type %s because is not an action signal",
-                         signal->signal_name,
+                         query->signal_name,
                          object_get_name (object),
                          G_OBJECT_TYPE_NAME (object));
 
-  /* Create values array */
-  values = g_array_new (FALSE, TRUE, sizeof (GValue));
-  g_array_set_size (values, signal->n_params + 1);
-  g_array_set_clear_func (values, (GDestroyNotify) g_value_unset);
+  clippy_return_if_fail (g_variant_n_children (params) == query->n_params + 1,
+                         error, CLIPPY_WRONG_SIGNAL_TYPE,
+                         "Signal '%s' takes %u parameters besides the object",
+                         query->signal_name,
+                         query->n_params);
+
+  if (!emitter->values)
+    {
+      emitter->values = g_new0 (GValue, query->n_params + 1);
+      emitter->variant_types = g_new0 (GVariantType *, query->n_params);
+      emitter->converters = g_new0 (VariantToValueFunc, query->n_params);
+      signal_emitter_init_values (emitter, emitter->values);
+
+      if (query->return_type && query->return_type != G_TYPE_NONE)
+        emitter->return_converter = value_to_variant_lookup (query->return_type & ~G_SIGNAL_TYPE_STATIC_SCOPE);
+    }
+
+  clippy_return_if_fail (!return_value || emitter->return_converter != value_unsupported_to_variant,
+                         error, CLIPPY_WRONG_SIGNAL_TYPE,
+                         "Signal '%s' returns %s which can not be sent over DBus",
+                         query->signal_name,
+                         g_type_name (query->return_type & ~G_SIGNAL_TYPE_STATIC_SCOPE));
+
+  /* Emissions from a signal handler get their own buffer */
+  if ((reentrant = emitter->busy))
+    {
+      values = g_new0 (GValue, query->n_params + 1);
+      signal_emitter_init_values (emitter, values);
+    }
+  else
+    values = emitter->values;
+
+  emitter->busy = TRUE;
 
   /* Set instance */
-  instance_and_params = &g_array_index (values, GValue, 0);
-  g_value_init_from_instance (instance_and_params, object);
+  g_value_set_object (values, object);
 
-  /* Set parameters */
-  for (guint i = 0; i < signal->n_params; i++)
+  /* Set parameters, resolving converters only when the variant type changes */
+  for (i = 0; i < query->n_params; i++)
     {
-      GValue *val = &g_array_index (values, GValue, i+1);
+      g_autoptr(GVariant) variant = g_variant_get_child_value (params, i+1);
+      const GVariantType *type = g_variant_get_type (variant);
+
+      if (!emitter->variant_types[i] || !g_variant_type_equal (emitter->variant_types[i], type))
+        {
+          g_clear_pointer (&emitter->variant_types[i], g_variant_type_free);
+          emitter->variant_types[i] = g_variant_type_copy (type);
+          emitter->converters[i] = variant_to_value_lookup (G_VALUE_TYPE (&values[i+1]), type);
+        }
 
-      variant = g_variant_get_child_value (params, i+1);
-      g_value_init (val, signal->param_types[i]);
-      value_set_variant (val, variant);
+      emitter->converters[i] (variant, &values[i+1]);
     }
 
   /* Setup return value */
-  if (signal->return_type && signal->return_type != G_TYPE_NONE)
-    g_value_init (&retval, signal->return_type);
+  if (query->return_type && query->return_type != G_TYPE_NONE)
+    g_value_init (&retval, query->return_type & ~G_SIGNAL_TYPE_STATIC_SCOPE);
 
   /* Emit signal */
-  g_signal_emitv (instance_and_params, signal->signal_id, g_quark_try_string (detail), &retval);
+  g_signal_emitv (values, query->signal_id, g_quark_try_string (detail), &retval);
+
+  if (return_value)
+    *return_value = emitter->return_converter ? emitter->return_converter (&retval) : NULL;
+
+  /* Drop references but keep value types for the next emission */
+  for (i = 0; i <= query->n_params; i++)
+    {
+      if (reentrant)
+        g_value_unset (&values[i]);
+      else
+        g_value_reset (&values[i]);
+    }
+
+  if (reentrant)
+    g_free (values);
+  else
+    emitter->busy = FALSE;
 }
 
 typedef struct
@@ -246,29 +466,34 @@ app_get_object (const gchar *name, GError **error)
       return NULL;
     }
 
-  app = g_application_get_default ();
-  if (app && (const_toplevels = GTK_IS_APPLICATION (app)))
-    toplevels = gtk_application_get_windows (GTK_APPLICATION (app));
-  else
-    toplevels = gdk_screen_get_toplevel_windows (gdk_screen_get_default ());
-
   /* name can have dot property access operator */
   tokens = g_strsplit (name, ".", -1);
   data.name = tokens[0];
 
-  for (l = toplevels; l; l = g_list_next (l))
+  if (*data.name == '#')
+    data.object = object_from_handle (data.name);
+  else
     {
-      if (!gtk_widget_is_visible (l->data))
-        continue;
-      
-      gtk_container_forall (l->data, find_object_forall, &data);
-      
-      if (data.object)
-        break;
-    }
+      app = g_application_get_default ();
+      if (app && (const_toplevels = GTK_IS_APPLICATION (app)))
+        toplevels = gtk_application_get_windows (GTK_APPLICATION (app));
+      else
+        toplevels = gdk_screen_get_toplevel_windows (gdk_screen_get_default ());
+
+      for (l = toplevels; l; l = g_list_next (l))
+        {
+          if (!gtk_widget_is_visible (l->data))
+            continue;
+
+          gtk_container_forall (l->data, find_object_forall, &data);
+
+          if (data.object)
+            break;
+        }
 
-  if (!const_toplevels)
-    g_list_free (toplevels);
+      if (!const_toplevels)
+        g_list_free (toplevels);
+    }
 
   clippy_return_val_if_fail (data.object,
                              NULL, error, CLIPPY_NO_OBJECT,
@@ -277,8 +502,7 @@ app_get_object (const gchar *name, GError **error)
 
   for (i = 1; tokens[i]; i++)
     {
-      GParamSpec *pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (data.object),
-                                                        tokens[i]);
+      GParamSpec *pspec = object_find_property (data.object, tokens[i]);
 
       /* Check if we are trying to access a JS object */
       if (pspec == NULL && app_is_jscontext_property (data.object, tokens[i]))
@@ -316,15 +540,14 @@ app_get_object_info (const gchar  *object,
     *gobject = o;
 
   if (property && pspec)
-    clippy_return_val_if_fail (*pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (o),
-                                                                      property),
+    clippy_return_val_if_fail (*pspec = object_find_property (o, property),
                                FALSE, error, CLIPPY_NO_PROPERTY,
                                "No property '%s' found on object '%s'",
                                property,
                                object);
 
   if (signal && signal_id)
-    clippy_return_val_if_fail (*signal_id = g_signal_lookup (signal, G_OBJECT_TYPE (o)),
+    clippy_return_val_if_fail (*signal_id = object_lookup_signal (o, signal),
                                FALSE, error, CLIPPY_NO_SIGNAL,
                                "Object '%s' of type %s has no signal '%s'",
                                object,
@@ -333,6 +556,66 @@ app_get_object_info (const gchar  *object,
   return TRUE;
 }
 
+/*
+ * Read a property from @object following the dot (.) property access
+ * operator, for example "parent.visible"
+ */
+gboolean
+object_get_property_path (GObject      *object,
+                          const gchar  *path,
+                          GValue       *value,
+                          GError      **error)
+{
+  g_auto(GStrv) tokens = g_strsplit (path, ".", -1);
+  GParamSpec *pspec = NULL;
+  gint i;
+
+  for (i = 0; tokens[i]; i++)
+    {
+      pspec = object_find_property (object, tokens[i]);
+
+      clippy_return_val_if_fail (pspec && (pspec->flags & G_PARAM_READABLE),
+                                 FALSE, error, CLIPPY_NO_PROPERTY,
+                                 "No readable property '%s' found on type %s",
+                                 tokens[i],
+                                 G_OBJECT_TYPE_NAME (object));
+
+      /* Last token is the property to read */
+      if (!tokens[i+1])
+        break;
+
+      clippy_return_val_if_fail (g_type_is_a (pspec->value_type, G_TYPE_OBJECT),
+                                 FALSE, error, CLIPPY_NO_OBJECT,
+                                 "Property '%s' from type %s is not an object type",
+                                 tokens[i],
+                                 G_OBJECT_TYPE_NAME (object));
+
+      g_object_get (object, tokens[i], &object, NULL);
+
+      clippy_return_val_if_fail (object,
+                                 FALSE, error, CLIPPY_NO_OBJECT,
+                                 "Property '%s' is not set",
+                                 tokens[i]);
+
+      /* The owner holds another reference, see app_get_gobject_property() */
+      g_object_unref (object);
+    }
+
+  if (!pspec)
+    {
+      g_set_error_literal (error,
+                           CLIPPY_ERROR,
+                           CLIPPY_NO_PROPERTY,
+                           "Empty property path");
+      return FALSE;
+    }
+
+  g_value_init (value, pspec->value_type);
+  g_object_get_property (object, pspec->name, value);
+
+  return TRUE;
+}
+
 const gchar *
 signature_from_type (GType type)
 {
@@ -354,6 +637,8 @@ signature_from_type (GType type)
     return "v";
   else if (type == G_TYPE_STRV)
     return "as";
+  else if (type == G_TYPE_BYTES)
+    return "ay";
   else if (type == G_TYPE_STRING || type == G_TYPE_GTYPE || type == G_TYPE_GSTRING ||
            (type == G_TYPE_OBJECT || g_type_is_a (type, G_TYPE_OBJECT)))
     return "s";
@@ -363,88 +648,444 @@ signature_from_type (GType type)
   return "v";
 }
 
-GVariant *
-variant_new_value (const GValue *value)
+/*
+ * GValue -> GVariant converters, resolved once per GType
+ */
+#define DEFINE_TO_VARIANT(name, vnew, vget) \
+static GVariant * \
+value_##name##_to_variant (const GValue *value) \
+{ \
+  return vnew (vget (value)); \
+}
+
+DEFINE_TO_VARIANT (char,    g_variant_new_byte,    g_value_get_schar)
+DEFINE_TO_VARIANT (uchar,   g_variant_new_byte,    g_value_get_uchar)
+DEFINE_TO_VARIANT (boolean, g_variant_new_boolean, g_value_get_boolean)
+DEFINE_TO_VARIANT (int,     g_variant_new_int64,   g_value_get_int)
+DEFINE_TO_VARIANT (uint,    g_variant_new_uint64,  g_value_get_uint)
+DEFINE_TO_VARIANT (long,    g_variant_new_int64,   g_value_get_long)
+DEFINE_TO_VARIANT (ulong,   g_variant_new_uint64,  g_value_get_ulong)
+DEFINE_TO_VARIANT (int64,   g_variant_new_int64,   g_value_get_int64)
+DEFINE_TO_VARIANT (uint64,  g_variant_new_uint64,  g_value_get_uint64)
+DEFINE_TO_VARIANT (enum,    g_variant_new_int64,   g_value_get_enum)
+DEFINE_TO_VARIANT (flags,   g_variant_new_uint64,  g_value_get_flags)
+DEFINE_TO_VARIANT (float,   g_variant_new_double,  g_value_get_float)
+DEFINE_TO_VARIANT (double,  g_variant_new_double,  g_value_get_double)
+DEFINE_TO_VARIANT (variant, g_variant_ref,         g_value_get_variant)
+
+static GVariant *
+value_string_to_variant (const GValue *value)
 {
-  GType type = G_VALUE_TYPE (value);
+  const gchar *string = g_value_get_string (value);
+  return g_variant_new_string (string ? string : "");
+}
 
-  if (type == G_TYPE_CHAR)
-    return g_variant_new_byte (g_value_get_schar (value));
-  else if (type == G_TYPE_UCHAR)
-    return g_variant_new_byte (g_value_get_uchar (value));
-  else if (type == G_TYPE_BOOLEAN)
-    return g_variant_new_boolean (g_value_get_boolean (value));
-  else if (type == G_TYPE_INT)
-    return g_variant_new_int64 (g_value_get_int (value));
-  else if (type == G_TYPE_UINT)
-    return g_variant_new_uint64 (g_value_get_uint (value));
-  else if (type == G_TYPE_LONG)
-    return g_variant_new_int64 (g_value_get_long (value));
-  else if (type == G_TYPE_ULONG)
-    return g_variant_new_uint64 (g_value_get_ulong (value));
-  else if (type == G_TYPE_INT64)
-    return g_variant_new_int64 (g_value_get_int64 (value));
-  else if (type == G_TYPE_UINT64)
-    return g_variant_new_uint64 (g_value_get_uint64 (value));
-  else if (type == G_TYPE_ENUM)
-    return g_variant_new_int64 (g_value_get_enum (value));
-  else if (type == G_TYPE_FLAGS)
-    return g_variant_new_uint64 (g_value_get_flags (value));
-  else if (type == G_TYPE_FLOAT)
-    return g_variant_new_double (g_value_get_float (value));
-  else if (type == G_TYPE_DOUBLE)
-    return g_variant_new_double (g_value_get_double (value));
-  else if (type == G_TYPE_STRING)
-    {
-      const gchar *string = g_value_get_string (value);
-      return g_variant_new_string (string ? string : "");
-    }
-  else if (type == G_TYPE_GTYPE)
-    return g_variant_new_string (g_type_name (g_value_get_gtype (value)));
-  else if (type == G_TYPE_VARIANT)
-    return g_value_dup_variant (value);
-  /* Boxed types */
+static GVariant *
+value_gtype_to_variant (const GValue *value)
+{
+  return g_variant_new_string (g_type_name (g_value_get_gtype (value)));
+}
+
+static GVariant *
+value_gstring_to_variant (const GValue *value)
+{
+  GString *string = g_value_get_boxed (value);
+  return g_variant_new_string ((string && string->str) ? string->str : "");
+}
+
+static GVariant *
+value_strv_to_variant (const GValue *value)
+{
+  const gchar **strv = g_value_get_boxed (value);
+  return g_variant_new_strv (strv, -1);
+}
+
+static GVariant *
+value_bytes_to_variant (const GValue *value)
+{
+  GBytes *bytes = g_value_get_boxed (value);
+
+  if (!bytes)
+    return g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, NULL, 0, 1);
+
+  /* Shares the bytes data, no copy */
+  return g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING, bytes, TRUE);
+}
+
+static GVariant *
+value_object_to_variant (const GValue *value)
+{
+  GObject *object = g_value_get_object (value);
+
+  /* Unnamed objects get a handle so they can be passed back to us */
+  return g_variant_new_string (object ? object_get_id (object) : "");
+}
+
+static GVariant *
+value_unsupported_to_variant (const GValue *value)
+{
+  return g_variant_new_string ("");
+}
+
+ValueToVariantFunc
+value_to_variant_lookup (GType type)
+{
+  /* Derived types first */
+  if (type == G_TYPE_GTYPE)
+    return value_gtype_to_variant;
   else if (type == G_TYPE_GSTRING)
-    {
-      GString *string = g_value_get_boxed (value);
-      return g_variant_new_string ((string && string->str) ? string->str : "");
-    }
+    return value_gstring_to_variant;
   else if (type == G_TYPE_STRV)
+    return value_strv_to_variant;
+  else if (type == G_TYPE_BYTES)
+    return value_bytes_to_variant;
+  else if (G_TYPE_IS_INTERFACE (type) && g_type_is_a (type, G_TYPE_OBJECT))
+    return value_object_to_variant;
+
+  switch (G_TYPE_FUNDAMENTAL (type))
     {
-      const gchar **strv = g_value_get_boxed (value);
-      return g_variant_new_strv (strv, -1);
+      case G_TYPE_CHAR:    return value_char_to_variant;
+      case G_TYPE_UCHAR:   return value_uchar_to_variant;
+      case G_TYPE_BOOLEAN: return value_boolean_to_variant;
+      case G_TYPE_INT:     return value_int_to_variant;
+      case G_TYPE_UINT:    return value_uint_to_variant;
+      case G_TYPE_LONG:    return value_long_to_variant;
+      case G_TYPE_ULONG:   return value_ulong_to_variant;
+      case G_TYPE_INT64:   return value_int64_to_variant;
+      case G_TYPE_UINT64:  return value_uint64_to_variant;
+      case G_TYPE_ENUM:    return value_enum_to_variant;
+      case G_TYPE_FLAGS:   return value_flags_to_variant;
+      case G_TYPE_FLOAT:   return value_float_to_variant;
+      case G_TYPE_DOUBLE:  return value_double_to_variant;
+      case G_TYPE_STRING:  return value_string_to_variant;
+      case G_TYPE_VARIANT: return value_variant_to_variant;
+      case G_TYPE_OBJECT:  return value_object_to_variant;
     }
-  else if (type == G_TYPE_OBJECT || g_type_is_a (type, G_TYPE_OBJECT))
+
+  return value_unsupported_to_variant;
+}
+
+GVariant *
+variant_new_value (const GValue *value)
+{
+  return value_to_variant_lookup (G_VALUE_TYPE (value)) (value);
+}
+
+gboolean
+variant_get_number (GVariant *variant, gdouble *number)
+{
+  switch (g_variant_classify (variant))
     {
-      const gchar *id = object_get_name (g_value_get_object (value));
-      return g_variant_new_string (id ? id : "");
+      case G_VARIANT_CLASS_BOOLEAN:
+        *number = g_variant_get_boolean (variant);
+      break;
+      case G_VARIANT_CLASS_BYTE:
+        *number = g_variant_get_byte (variant);
+      break;
+      case G_VARIANT_CLASS_INT16:
+        *number = g_variant_get_int16 (variant);
+      break;
+      case G_VARIANT_CLASS_UINT16:
+        *number = g_variant_get_uint16 (variant);
+      break;
+      case G_VARIANT_CLASS_INT32:
+        *number = g_variant_get_int32 (variant);
+      break;
+      case G_VARIANT_CLASS_UINT32:
+        *number = g_variant_get_uint32 (variant);
+      break;
+      case G_VARIANT_CLASS_INT64:
+        *number = g_variant_get_int64 (variant);
+      break;
+      case G_VARIANT_CLASS_UINT64:
+        *number = g_variant_get_uint64 (variant);
+      break;
+      case G_VARIANT_CLASS_DOUBLE:
+        *number = g_variant_get_double (variant);
+      break;
+      default:
+        return FALSE;
     }
 
-  return g_variant_new_string ("");
+  return TRUE;
 }
 
+/*
+ * Clients can not know which integer type variant_new_value() will use, so
+ * numbers are compared by value regardless of their variant type
+ */
 gboolean
-value_set_variant (GValue *value, GVariant *variant)
+variant_equal_value (GVariant *a, GVariant *b)
 {
-  GType type = G_VALUE_TYPE (value);
+  gdouble na, nb;
 
-  if (type == G_TYPE_GTYPE)
-    g_value_set_gtype (value, g_type_from_name (g_variant_get_string (variant, NULL)));
-  else if (type == G_TYPE_OBJECT || g_type_is_a (type, G_TYPE_OBJECT))
+  if (variant_get_number (a, &na) && variant_get_number (b, &nb))
+    return na == nb;
+
+  return g_variant_equal (a, b);
+}
+
+/*
+ * GVariant -> GValue converters, resolved once per (GType, variant type)
+ * pair. Numbers are written straight into the destination value.
+ */
+#define DEFINE_FROM_VARIANT(vname, vget, name, vset) \
+static gboolean \
+variant_##vname##_to_##name (GVariant *variant, GValue *value) \
+{ \
+  vset (value, vget (variant)); \
+  return TRUE; \
+}
+
+#define DEFINE_FROM_NUMBER_VARIANTS(name, vset) \
+  DEFINE_FROM_VARIANT (boolean, g_variant_get_boolean, name, vset) \
+  DEFINE_FROM_VARIANT (byte,    g_variant_get_byte,    name, vset) \
+  DEFINE_FROM_VARIANT (int16,   g_variant_get_int16,   name, vset) \
+  DEFINE_FROM_VARIANT (uint16,  g_variant_get_uint16,  name, vset) \
+  DEFINE_FROM_VARIANT (int32,   g_variant_get_int32,   name, vset) \
+  DEFINE_FROM_VARIANT (uint32,  g_variant_get_uint32,  name, vset) \
+  DEFINE_FROM_VARIANT (int64,   g_variant_get_int64,   name, vset) \
+  DEFINE_FROM_VARIANT (uint64,  g_variant_get_uint64,  name, vset) \
+  DEFINE_FROM_VARIANT (double,  g_variant_get_double,  name, vset)
+
+/* Same order as variant_number_index() */
+#define FROM_NUMBER_VARIANTS(name) \
+  { variant_boolean_to_##name, variant_byte_to_##name, \
+    variant_int16_to_##name, variant_uint16_to_##name, \
+    variant_int32_to_##name, variant_uint32_to_##name, \
+    variant_int64_to_##name, variant_uint64_to_##name, \
+    variant_double_to_##name }
+
+DEFINE_FROM_NUMBER_VARIANTS (char,    g_value_set_schar)
+DEFINE_FROM_NUMBER_VARIANTS (uchar,   g_value_set_uchar)
+DEFINE_FROM_NUMBER_VARIANTS (boolean, g_value_set_boolean)
+DEFINE_FROM_NUMBER_VARIANTS (int,     g_value_set_int)
+DEFINE_FROM_NUMBER_VARIANTS (uint,    g_value_set_uint)
+DEFINE_FROM_NUMBER_VARIANTS (long,    g_value_set_long)
+DEFINE_FROM_NUMBER_VARIANTS (ulong,   g_value_set_ulong)
+DEFINE_FROM_NUMBER_VARIANTS (int64,   g_value_set_int64)
+DEFINE_FROM_NUMBER_VARIANTS (uint64,  g_value_set_uint64)
+DEFINE_FROM_NUMBER_VARIANTS (enum,    g_value_set_enum)
+DEFINE_FROM_NUMBER_VARIANTS (flags,   g_value_set_flags)
+DEFINE_FROM_NUMBER_VARIANTS (float,   g_value_set_float)
+DEFINE_FROM_NUMBER_VARIANTS (double,  g_value_set_double)
+
+#define N_NUMBER_VARIANTS 9
+
+static const VariantToValueFunc from_number_variants[][N_NUMBER_VARIANTS] = {
+  FROM_NUMBER_VARIANTS (char),
+  FROM_NUMBER_VARIANTS (uchar),
+  FROM_NUMBER_VARIANTS (boolean),
+  FROM_NUMBER_VARIANTS (int),
+  FROM_NUMBER_VARIANTS (uint),
+  FROM_NUMBER_VARIANTS (long),
+  FROM_NUMBER_VARIANTS (ulong),
+  FROM_NUMBER_VARIANTS (int64),
+  FROM_NUMBER_VARIANTS (uint64),
+  FROM_NUMBER_VARIANTS (enum),
+  FROM_NUMBER_VARIANTS (flags),
+  FROM_NUMBER_VARIANTS (float),
+  FROM_NUMBER_VARIANTS (double)
+};
+
+static gint
+variant_number_index (const GVariantType *type)
+{
+  switch (g_variant_type_peek_string (type)[0])
     {
-      const gchar *object = g_variant_get_string (variant, NULL);
-      g_value_set_object (value, app_get_object (object, NULL));
+      case 'b': return 0;
+      case 'y': return 1;
+      case 'n': return 2;
+      case 'q': return 3;
+      case 'i': return 4;
+      case 'u': return 5;
+      case 'x': return 6;
+      case 't': return 7;
+      case 'd': return 8;
     }
-  else
+
+  return -1;
+}
+
+static gint
+value_number_index (GType type)
+{
+  switch (G_TYPE_FUNDAMENTAL (type))
     {
-      g_auto(GValue) gvalue = G_VALUE_INIT;
-      g_dbus_gvariant_to_gvalue (variant, &gvalue);
-      g_value_transform (&gvalue, value);
+      case G_TYPE_CHAR:    return 0;
+      case G_TYPE_UCHAR:   return 1;
+      case G_TYPE_BOOLEAN: return 2;
+      case G_TYPE_INT:     return 3;
+      case G_TYPE_UINT:    return 4;
+      case G_TYPE_LONG:    return 5;
+      case G_TYPE_ULONG:   return 6;
+      case G_TYPE_INT64:   return 7;
+      case G_TYPE_UINT64:  return 8;
+      case G_TYPE_ENUM:    return 9;
+      case G_TYPE_FLAGS:   return 10;
+      case G_TYPE_FLOAT:   return 11;
+      case G_TYPE_DOUBLE:  return 12;
     }
 
+  return -1;
+}
+
+static gboolean
+variant_to_string (GVariant *variant, GValue *value)
+{
+  g_value_set_string (value, g_variant_get_string (variant, NULL));
   return TRUE;
 }
 
+static gboolean
+variant_to_strv (GVariant *variant, GValue *value)
+{
+  g_value_take_boxed (value, g_variant_dup_strv (variant, NULL));
+  return TRUE;
+}
+
+static gboolean
+variant_to_bytes (GVariant *variant, GValue *value)
+{
+  /* Shares the variant data, mapped memfds are not copied */
+  g_value_take_boxed (value, g_variant_get_data_as_bytes (variant));
+  return TRUE;
+}
+
+static gboolean
+variant_to_gtype (GVariant *variant, GValue *value)
+{
+  g_value_set_gtype (value, g_type_from_name (g_variant_get_string (variant, NULL)));
+  return TRUE;
+}
+
+static gboolean
+variant_to_object (GVariant *variant, GValue *value)
+{
+  const gchar *object = g_variant_get_string (variant, NULL);
+  g_value_set_object (value, app_get_object (object, NULL));
+  return TRUE;
+}
+
+static gboolean
+variant_to_gvariant (GVariant *variant, GValue *value)
+{
+  g_value_set_variant (value, variant);
+  return TRUE;
+}
+
+/* Generic conversion for everything else */
+static gboolean
+variant_transform_to_value (GVariant *variant, GValue *value)
+{
+  g_auto(GValue) gvalue = G_VALUE_INIT;
+
+  g_dbus_gvariant_to_gvalue (variant, &gvalue);
+  return g_value_transform (&gvalue, value);
+}
+
+VariantToValueFunc
+variant_to_value_lookup (GType type, const GVariantType *variant_type)
+{
+  gint value_index, variant_index;
+  gboolean string;
+
+  string = g_variant_type_equal (variant_type, G_VARIANT_TYPE_STRING) ||
+           g_variant_type_equal (variant_type, G_VARIANT_TYPE_OBJECT_PATH) ||
+           g_variant_type_equal (variant_type, G_VARIANT_TYPE_SIGNATURE);
+
+  if (type == G_TYPE_VARIANT)
+    return variant_to_gvariant;
+  else if (type == G_TYPE_GTYPE && string)
+    return variant_to_gtype;
+  else if (type == G_TYPE_STRV && g_variant_type_equal (variant_type, G_VARIANT_TYPE_STRING_ARRAY))
+    return variant_to_strv;
+  else if (type == G_TYPE_BYTES && g_variant_type_equal (variant_type, G_VARIANT_TYPE_BYTESTRING))
+    return variant_to_bytes;
+  else if (g_type_is_a (type, G_TYPE_OBJECT) && string)
+    return variant_to_object;
+  else if (G_TYPE_FUNDAMENTAL (type) == G_TYPE_STRING && string)
+    return variant_to_string;
+
+  value_index = value_number_index (type);
+  variant_index = variant_number_index (variant_type);
+
+  if (value_index >= 0 && variant_index >= 0)
+    return from_number_variants[value_index][variant_index];
+
+  return variant_transform_to_value;
+}
+
+gboolean
+value_set_variant (GValue *value, GVariant *variant)
+{
+  VariantToValueFunc func;
+
+  func = variant_to_value_lookup (G_VALUE_TYPE (value), g_variant_get_type (variant));
+  return func (variant, value);
+}
+
+/*
+ * Converters cached on the pspec, so property marshalling does not have to
+ * look them up again.
+ */
+typedef struct
+{
+  ValueToVariantFunc  to_variant;
+  GVariantType       *variant_type; /* Last variant type converted from */
+  VariantToValueFunc  from_variant;
+} PspecConverters;
+
+static void
+pspec_converters_free (gpointer data)
+{
+  PspecConverters *converters = data;
+
+  g_clear_pointer (&converters->variant_type, g_variant_type_free);
+  g_free (converters);
+}
+
+static PspecConverters *
+pspec_get_converters (GParamSpec *pspec)
+{
+  static GQuark quark = 0;
+  PspecConverters *converters;
+
+  if (G_UNLIKELY (!quark))
+    quark = g_quark_from_static_string ("ClippyConverters");
+
+  if ((converters = g_param_spec_get_qdata (pspec, quark)))
+    return converters;
+
+  converters = g_new0 (PspecConverters, 1);
+  converters->to_variant = value_to_variant_lookup (pspec->value_type);
+  g_param_spec_set_qdata_full (pspec, quark, converters, pspec_converters_free);
+
+  return converters;
+}
+
+GVariant *
+pspec_variant_new_value (GParamSpec *pspec, const GValue *value)
+{
+  return pspec_get_converters (pspec)->to_variant (value);
+}
+
+gboolean
+pspec_value_set_variant (GParamSpec *pspec, GValue *value, GVariant *variant)
+{
+  PspecConverters *converters = pspec_get_converters (pspec);
+  const GVariantType *type = g_variant_get_type (variant);
+
+  if (!converters->variant_type || !g_variant_type_equal (converters->variant_type, type))
+    {
+      g_clear_pointer (&converters->variant_type, g_variant_type_free);
+      converters->variant_type = g_variant_type_copy (type);
+      converters->from_variant = variant_to_value_lookup (pspec->value_type, type);
+    }
+
+  return converters->from_variant (variant, value);
+}
+
 void
 str_replace_char (gchar *str, gchar a, gchar b)
 {
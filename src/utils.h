@@ -35,7 +35,9 @@ typedef enum
   CLIPPY_NO_DETAIL,
   CLIPPY_NOT_A_WIDGET,
   CLIPPY_WRONG_SIGNAL_TYPE,
-  CLIPPY_WRONG_MSG_ID
+  CLIPPY_WRONG_MSG_ID,
+  CLIPPY_NO_TYPE,
+  CLIPPY_WRONG_OPTION
 } ClippyError;
 
 GQuark clippy_quark (void);
@@ -57,10 +59,23 @@ GQuark clippy_quark (void);
 
 const gchar *object_get_name     (GObject      *object);
 
+const gchar *object_get_handle   (GObject      *object);
+
+GObject     *object_from_handle  (const gchar  *handle);
+
+const gchar *object_get_id       (GObject      *object);
+
+GParamSpec  *object_find_property (GObject      *object,
+                                   const gchar  *property);
+
+guint        object_lookup_signal (GObject      *object,
+                                   const gchar  *signal);
+
 void         object_emit_action_signal (GObject      *object,
-                                        GSignalQuery *signal,
+                                        const gchar  *signal,
                                         const gchar  *detail,
                                         GVariant     *params,
+                                        GVariant    **return_value,
                                         GError      **error);
 
 gboolean     app_get_object_info (const gchar  *object,
@@ -71,13 +86,39 @@ gboolean     app_get_object_info (const gchar  *object,
                                   guint        *signal_id,
                                   GError      **error);
 
+gboolean     object_get_property_path (GObject      *object,
+                                       const gchar  *path,
+                                       GValue       *value,
+                                       GError      **error);
+
 const gchar *signature_from_type (GType type);
 
+typedef GVariant *(*ValueToVariantFunc) (const GValue *value);
+typedef gboolean  (*VariantToValueFunc) (GVariant     *variant,
+                                         GValue       *value);
+
+ValueToVariantFunc value_to_variant_lookup (GType               type);
+VariantToValueFunc variant_to_value_lookup (GType               type,
+                                            const GVariantType *variant_type);
+
 GVariant    *variant_new_value   (const GValue *value);
 
+GVariant    *pspec_variant_new_value (GParamSpec   *pspec,
+                                      const GValue *value);
+
+gboolean     variant_get_number  (GVariant     *variant,
+                                  gdouble      *number);
+
+gboolean     variant_equal_value (GVariant     *a,
+                                  GVariant     *b);
+
 gboolean     value_set_variant   (GValue       *value,
                                   GVariant     *variant);
 
+gboolean     pspec_value_set_variant (GParamSpec   *pspec,
+                                      GValue       *value,
+                                      GVariant     *variant);
+
 void         str_replace_char    (gchar        *str,
                                   gchar         a,
                                   gchar         b);